@@ -253,7 +253,7 @@ int main(int argc, char* const argv[])
 
     runtime.mParentDir = parentDir;
 
-    isXposedLoaded = xposed::initialize(zygote, startSystemServer, className, argc, argv);
+    isXposedLoaded = xposed::initialize(zygote, startSystemServer, className, argc, argv, i);
     if (zygote) {
         runtime.start(isXposedLoaded ? XPOSED_CLASS_DOTS_ZYGOTE : "com.android.internal.os.ZygoteInit",
                 startSystemServer ? "start-system-server" : "");
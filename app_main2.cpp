@@ -352,10 +352,10 @@ int main(int argc, char* const argv[])
     }
 
     if (zygote) {
-        isXposedLoaded = xposed::initialize(true, startSystemServer, NULL, argc, argv);
+        isXposedLoaded = xposed::initialize(true, startSystemServer, NULL, argc, argv, i);
         runtimeStart(runtime, isXposedLoaded ? XPOSED_CLASS_DOTS_ZYGOTE : "com.android.internal.os.ZygoteInit", args, zygote);
     } else if (className) {
-        isXposedLoaded = xposed::initialize(false, false, className, argc, argv);
+        isXposedLoaded = xposed::initialize(false, false, className, argc, argv, i);
         runtimeStart(runtime, isXposedLoaded ? XPOSED_CLASS_DOTS_TOOLS : "com.android.internal.os.RuntimeInit", args, zygote);
     } else {
         fprintf(stderr, "Error: no class name or --zygote supplied.\n");
@@ -0,0 +1,22 @@
+/**
+ * Host stand-in for local binder objects, transactions are direct calls of onTransact().
+ */
+
+#ifndef XPOSED_HOST_BINDER_BINDER_H_
+#define XPOSED_HOST_BINDER_BINDER_H_
+
+#include <binder/IBinder.h>
+
+namespace android {
+
+class BBinder : public IBinder {
+  public:
+    virtual status_t transact(uint32_t code, const Parcel& data, Parcel* reply, uint32_t flags = 0);
+
+  protected:
+    virtual status_t onTransact(uint32_t code, const Parcel& data, Parcel* reply, uint32_t flags = 0);
+};
+
+}  // namespace android
+
+#endif  // XPOSED_HOST_BINDER_BINDER_H_
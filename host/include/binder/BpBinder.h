@@ -0,0 +1,20 @@
+/**
+ * Host stand-in for binder objects in other processes. There is no IPC on the host, so every
+ * transaction succeeds with an empty reply.
+ */
+
+#ifndef XPOSED_HOST_BINDER_BPBINDER_H_
+#define XPOSED_HOST_BINDER_BPBINDER_H_
+
+#include <binder/IBinder.h>
+
+namespace android {
+
+class BpBinder : public IBinder {
+  public:
+    virtual status_t transact(uint32_t code, const Parcel& data, Parcel* reply, uint32_t flags = 0);
+};
+
+}  // namespace android
+
+#endif  // XPOSED_HOST_BINDER_BPBINDER_H_
@@ -0,0 +1,26 @@
+#ifndef XPOSED_HOST_BINDER_IBINDER_H_
+#define XPOSED_HOST_BINDER_IBINDER_H_
+
+#include <stdint.h>
+
+#include <utils/Errors.h>
+#include <utils/StrongPointer.h>
+
+namespace android {
+
+class Parcel;
+
+class IBinder {
+  public:
+    enum {
+        FIRST_CALL_TRANSACTION = 0x00000001,
+        LAST_CALL_TRANSACTION  = 0x00ffffff,
+    };
+
+    virtual ~IBinder() {}
+    virtual status_t transact(uint32_t code, const Parcel& data, Parcel* reply, uint32_t flags = 0) = 0;
+};
+
+}  // namespace android
+
+#endif  // XPOSED_HOST_BINDER_IBINDER_H_
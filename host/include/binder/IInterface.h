@@ -0,0 +1,60 @@
+#ifndef XPOSED_HOST_BINDER_IINTERFACE_H_
+#define XPOSED_HOST_BINDER_IINTERFACE_H_
+
+#include <binder/Binder.h>
+#include <utils/String16.h>
+
+namespace android {
+
+class IInterface {
+  public:
+    virtual ~IInterface() {}
+};
+
+template<typename INTERFACE>
+class BnInterface : public INTERFACE, public BBinder {};
+
+template<typename INTERFACE>
+class BpInterface : public INTERFACE {
+  public:
+    explicit BpInterface(const sp<IBinder>& remote) : mRemote(remote) {}
+
+  protected:
+    IBinder* remote() const { return mRemote.get(); }
+
+  private:
+    sp<IBinder> mRemote;
+};
+
+template<typename INTERFACE>
+inline sp<INTERFACE> interface_cast(const sp<IBinder>& obj) {
+    return INTERFACE::asInterface(obj);
+}
+
+}  // namespace android
+
+#define DECLARE_META_INTERFACE(INTERFACE)                                                   \
+    static const ::android::String16& getInterfaceDescriptor();                            \
+    static ::android::sp<I##INTERFACE> asInterface(const ::android::sp<::android::IBinder>& obj);
+
+// Objects in this process are used directly, all others are proxied
+#define IMPLEMENT_META_INTERFACE(INTERFACE, NAME)                                           \
+    const ::android::String16& I##INTERFACE::getInterfaceDescriptor() {                    \
+        static const ::android::String16 descriptor(NAME);                                  \
+        return descriptor;                                                                  \
+    }                                                                                       \
+    ::android::sp<I##INTERFACE> I##INTERFACE::asInterface(const ::android::sp<::android::IBinder>& obj) { \
+        if (obj.get() == NULL)                                                              \
+            return ::android::sp<I##INTERFACE>();                                           \
+        I##INTERFACE* local = dynamic_cast<I##INTERFACE*>(obj.get());                       \
+        if (local != NULL)                                                                  \
+            return local;                                                                   \
+        return new Bp##INTERFACE(obj);                                                      \
+    }
+
+#define CHECK_INTERFACE(interface, data, reply)                                             \
+    if (!(data).checkInterface(interface::getInterfaceDescriptor())) {                     \
+        return ::android::PERMISSION_DENIED;                                                \
+    }
+
+#endif  // XPOSED_HOST_BINDER_IINTERFACE_H_
@@ -0,0 +1,21 @@
+#ifndef XPOSED_HOST_BINDER_IPCTHREADSTATE_H_
+#define XPOSED_HOST_BINDER_IPCTHREADSTATE_H_
+
+#include <sys/types.h>
+
+namespace android {
+
+class IPCThreadState {
+  public:
+    static IPCThreadState* self();
+
+    pid_t getCallingPid() const;
+    uid_t getCallingUid() const;
+
+    // Never returns, like on a device. The host tools kill the helper processes when they are done.
+    void joinThreadPool(bool isMain = true);
+};
+
+}  // namespace android
+
+#endif  // XPOSED_HOST_BINDER_IPCTHREADSTATE_H_
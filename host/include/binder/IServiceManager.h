@@ -0,0 +1,26 @@
+/**
+ * Host stand-in for the service manager. Services are only registered within the process,
+ * unknown services are returned as BpBinder.
+ */
+
+#ifndef XPOSED_HOST_BINDER_ISERVICEMANAGER_H_
+#define XPOSED_HOST_BINDER_ISERVICEMANAGER_H_
+
+#include <binder/IInterface.h>
+
+namespace android {
+
+class IServiceManager {
+  public:
+    virtual ~IServiceManager() {}
+
+    sp<IBinder> getService(const String16& name) const;
+    sp<IBinder> checkService(const String16& name) const;
+    status_t addService(const String16& name, const sp<IBinder>& service, bool allowIsolated = false);
+};
+
+sp<IServiceManager> defaultServiceManager();
+
+}  // namespace android
+
+#endif  // XPOSED_HOST_BINDER_ISERVICEMANAGER_H_
@@ -0,0 +1,47 @@
+/**
+ * Host stand-in for Parcel, a plain buffer. Reading beyond the end returns zeros, like the
+ * real implementation does.
+ */
+
+#ifndef XPOSED_HOST_BINDER_PARCEL_H_
+#define XPOSED_HOST_BINDER_PARCEL_H_
+
+#include <vector>
+
+#include <binder/IBinder.h>
+#include <utils/String16.h>
+#include <utils/String8.h>
+
+namespace android {
+
+class Parcel {
+  public:
+    Parcel() : pos(0) {}
+
+    size_t dataAvail() const { return data.size() - pos; }
+    void setDataPosition(size_t position) const { pos = position; }
+
+    status_t write(const void* buffer, size_t len);
+    status_t writeInt32(int32_t value);
+    status_t writeInt64(int64_t value);
+    status_t writeString16(const String16& str);
+    status_t writeStrongBinder(const sp<IBinder>& binder);
+    status_t writeInterfaceToken(const String16& interface);
+    status_t writeNoException();
+
+    status_t read(void* buffer, size_t len) const;
+    int32_t readInt32() const;
+    int64_t readInt64() const;
+    String16 readString16() const;
+    sp<IBinder> readStrongBinder() const;
+    int32_t readExceptionCode() const;
+    bool checkInterface(const String16& interface) const;
+
+  private:
+    std::vector<uint8_t> data;
+    mutable size_t pos;
+};
+
+}  // namespace android
+
+#endif  // XPOSED_HOST_BINDER_PARCEL_H_
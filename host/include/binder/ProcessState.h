@@ -0,0 +1,18 @@
+#ifndef XPOSED_HOST_BINDER_PROCESSSTATE_H_
+#define XPOSED_HOST_BINDER_PROCESSSTATE_H_
+
+#include <utils/StrongPointer.h>
+
+namespace android {
+
+class ProcessState {
+  public:
+    static sp<ProcessState> self();
+
+    void startThreadPool() {}
+    void giveThreadPoolName() {}
+};
+
+}  // namespace android
+
+#endif  // XPOSED_HOST_BINDER_PROCESSSTATE_H_
@@ -0,0 +1,13 @@
+/**
+ * Host stand-in for ashmem, regions are backed by memfd_create().
+ */
+
+#ifndef XPOSED_HOST_CUTILS_ASHMEM_H_
+#define XPOSED_HOST_CUTILS_ASHMEM_H_
+
+#include <stddef.h>
+
+extern "C" int ashmem_create_region(const char* name, size_t size);
+extern "C" int ashmem_set_prot_region(int fd, int prot);
+
+#endif  // XPOSED_HOST_CUTILS_ASHMEM_H_
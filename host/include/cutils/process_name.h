@@ -0,0 +1,10 @@
+/**
+ * Host stand-in for the process name functions of libcutils.
+ */
+
+#ifndef XPOSED_HOST_CUTILS_PROCESS_NAME_H_
+#define XPOSED_HOST_CUTILS_PROCESS_NAME_H_
+
+extern "C" void set_process_name(const char* process_name);
+
+#endif  // XPOSED_HOST_CUTILS_PROCESS_NAME_H_
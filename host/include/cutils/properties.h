@@ -0,0 +1,14 @@
+/**
+ * Host stand-in for the system properties, which are read from XPOSED_HOST_PROPERTIES.
+ */
+
+#ifndef XPOSED_HOST_CUTILS_PROPERTIES_H_
+#define XPOSED_HOST_CUTILS_PROPERTIES_H_
+
+#define PROPERTY_KEY_MAX   32
+#define PROPERTY_VALUE_MAX 92
+
+extern "C" int property_get(const char* key, char* value, const char* default_value);
+extern "C" int property_set(const char* key, const char* value);
+
+#endif  // XPOSED_HOST_CUTILS_PROPERTIES_H_
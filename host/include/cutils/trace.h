@@ -0,0 +1,13 @@
+/**
+ * Host stand-in for atrace. The host build records its timings with the startup timeline only.
+ */
+
+#ifndef XPOSED_HOST_CUTILS_TRACE_H_
+#define XPOSED_HOST_CUTILS_TRACE_H_
+
+#define ATRACE_TAG_DALVIK (1 << 14)
+
+#define ATRACE_BEGIN(name) ((void) (name))
+#define ATRACE_END() ((void) 0)
+
+#endif  // XPOSED_HOST_CUTILS_TRACE_H_
@@ -0,0 +1,21 @@
+/**
+ * Declarations which bionic provides in its standard headers, but glibc doesn't.
+ * This header is included before every source file of the host build.
+ */
+
+#ifndef XPOSED_HOST_COMPAT_H_
+#define XPOSED_HOST_COMPAT_H_
+
+#include <grp.h>     // setgroups(), bionic declares it in <unistd.h>
+#include <limits.h>  // the following are included by the Android headers
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#if !__GLIBC_PREREQ(2, 38)
+extern "C" size_t strlcpy(char* dst, const char* src, size_t size);
+#endif
+
+#endif  // XPOSED_HOST_COMPAT_H_
@@ -0,0 +1,11 @@
+/**
+ * Host stand-in for jni.h. The startup code only passes JNIEnv pointers through.
+ */
+
+#ifndef XPOSED_HOST_JNI_H_
+#define XPOSED_HOST_JNI_H_
+
+struct _JNIEnv;
+typedef _JNIEnv JNIEnv;
+
+#endif  // XPOSED_HOST_JNI_H_
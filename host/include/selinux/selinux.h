@@ -0,0 +1,15 @@
+/**
+ * Host stand-in for libselinux. SELinux is reported as disabled, unless XPOSED_HOST_SELINUX is set
+ * to "permissive" or "enforcing" in the environment. Context switches always succeed.
+ */
+
+#ifndef XPOSED_HOST_SELINUX_SELINUX_H_
+#define XPOSED_HOST_SELINUX_SELINUX_H_
+
+typedef char* security_context_t;
+
+extern "C" int is_selinux_enabled(void);
+extern "C" int security_getenforce(void);
+extern "C" int setcon(security_context_t context);
+
+#endif  // XPOSED_HOST_SELINUX_SELINUX_H_
@@ -0,0 +1,12 @@
+/**
+ * Host stand-in for bionic's <sys/capability.h>, glibc has no wrapper for capset().
+ */
+
+#ifndef XPOSED_HOST_SYS_CAPABILITY_H_
+#define XPOSED_HOST_SYS_CAPABILITY_H_
+
+#include <linux/capability.h>
+
+extern "C" int capset(cap_user_header_t hdrp, const cap_user_data_t datap);
+
+#endif  // XPOSED_HOST_SYS_CAPABILITY_H_
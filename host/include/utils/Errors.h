@@ -0,0 +1,20 @@
+#ifndef XPOSED_HOST_UTILS_ERRORS_H_
+#define XPOSED_HOST_UTILS_ERRORS_H_
+
+#include <errno.h>
+#include <stdint.h>
+
+namespace android {
+
+typedef int32_t status_t;
+
+enum {
+    OK                  = 0,
+    NO_ERROR            = 0,
+    PERMISSION_DENIED   = -EPERM,
+    UNKNOWN_TRANSACTION = -EBADMSG,
+};
+
+}  // namespace android
+
+#endif  // XPOSED_HOST_UTILS_ERRORS_H_
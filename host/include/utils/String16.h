@@ -0,0 +1,26 @@
+/**
+ * Host stand-in for String16, which keeps the UTF-8 data. It is never sent to another process.
+ */
+
+#ifndef XPOSED_HOST_UTILS_STRING16_H_
+#define XPOSED_HOST_UTILS_STRING16_H_
+
+#include <string>
+
+namespace android {
+
+class String16 {
+  public:
+    String16() {}
+    explicit String16(const char* str) : data(str) {}
+    String16(const char* str, size_t len) : data(str, len) {}
+
+    const std::string& utf8() const { return data; }
+
+  private:
+    std::string data;
+};
+
+}  // namespace android
+
+#endif  // XPOSED_HOST_UTILS_STRING16_H_
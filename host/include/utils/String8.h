@@ -0,0 +1,24 @@
+#ifndef XPOSED_HOST_UTILS_STRING8_H_
+#define XPOSED_HOST_UTILS_STRING8_H_
+
+#include <string>
+
+#include <utils/String16.h>
+
+namespace android {
+
+class String8 {
+  public:
+    String8() {}
+    explicit String8(const char* str) : data(str) {}
+    explicit String8(const String16& str) : data(str.utf8()) {}
+
+    const char* string() const { return data.c_str(); }
+
+  private:
+    std::string data;
+};
+
+}  // namespace android
+
+#endif  // XPOSED_HOST_UTILS_STRING8_H_
@@ -0,0 +1,32 @@
+/**
+ * Host stand-in for sp<>. There is no reference counting, the objects which are passed around
+ * (services, the service manager) are never released anyway.
+ */
+
+#ifndef XPOSED_HOST_UTILS_STRONGPOINTER_H_
+#define XPOSED_HOST_UTILS_STRONGPOINTER_H_
+
+#include <stddef.h>
+
+namespace android {
+
+template<typename T>
+class sp {
+  public:
+    sp() : ptr(NULL) {}
+    template<typename U> sp(U* other) : ptr(other) {}
+    template<typename U> sp(const sp<U>& other) : ptr(other.get()) {}
+
+    T* get() const { return ptr; }
+    T* operator->() const { return ptr; }
+    T& operator*() const { return *ptr; }
+    bool operator==(const T* other) const { return ptr == other; }
+    bool operator!=(const T* other) const { return ptr != other; }
+
+  private:
+    T* ptr;
+};
+
+}  // namespace android
+
+#endif  // XPOSED_HOST_UTILS_STRONGPOINTER_H_
@@ -0,0 +1,18 @@
+/**
+ * Runs the throughput benchmark of the log daemon (--xposedbenchlog) on the host. The lines are
+ * generated and processed exactly like on a device, the log is written to XPOSEDLOG_BENCH_FILE.
+ *
+ * Usage: log_benchmark [<lines/s> [<seconds> [<min length> [<max length> [<repeat %>]]]]]
+ */
+
+#include "xposed.h"
+#include "xposed_logcat.h"
+
+#include <stdlib.h>
+#include <sys/stat.h>
+
+int main(int argc, char* argv[]) {
+    mkdir(XPOSED_HOST_ROOT, 0755);
+    xposed::logcat::runBenchmark(argc - 1, argv + 1);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,25 @@
+/**
+ * Stand-in for libxposed_art.so. There is no VM on the host, so the library only does what
+ * the real one does before it calls into XposedBridge: waiting for the safemode result.
+ */
+
+#define LOG_TAG "Xposed"
+
+#include "xposed_shared.h"
+
+namespace xposed {
+
+static XposedShared* shared = NULL;
+
+static void onVmCreated(JNIEnv*) {
+    if (shared->checkSafemode != NULL && shared->checkSafemode())
+        ALOGI("Safemode triggered, not loading XposedBridge");
+}
+
+extern "C" bool xposedInitLib(XposedShared* sharedIn) {
+    shared = sharedIn;
+    shared->onVmCreated = &onVmCreated;
+    return true;
+}
+
+}  // namespace xposed
@@ -0,0 +1,303 @@
+/**
+ * Runs the background safemode detection against scripted key presses and checks the decision,
+ * the vibrations and the delay that checkSafemode() adds to the startup after the VM was created.
+ * If no key is held or pressed before the VM was created, the detection is expected to end there.
+ *
+ * The input device is a FIFO in SAFEMODE_DEVICE_PATH which receives the scripted input_events.
+ * The key capabilities, the device name and the initially held key are answered by __wrap_ioctl(), because
+ * uinput would need root and /dev/uinput. The binary is linked with -Wl,--wrap=ioctl.
+ *
+ * Usage: safemode_scenarios [--vm-start <ms>] [--verbose]
+ */
+
+#define LOG_TAG "Xposed"
+
+#include "xposed.h"
+#include "xposed_safemode.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/input.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEVICE_FILE        SAFEMODE_DEVICE_PATH "/event0"
+#define DEVICE_NAME        "Scripted keys"
+#define VIBRATOR_FILE      XPOSED_HOST_ROOT "/vibrator"
+#define MAX_SCRIPTED_KEYS  8
+
+// Scheduling of the processes and threads, the detection itself works with ms precision
+#define TOLERANCE_MS       150
+
+#define VIBRATION_LONG     500
+
+struct ScriptedKey {
+    int timeMs;
+    int code;
+};
+
+struct Scenario {
+    const char* name;
+    int heldKey;                             // reported by EVIOCGKEY when the device is opened
+    ScriptedKey presses[MAX_SCRIPTED_KEYS];  // terminated by code 0
+    bool expectTriggered;
+    int expectDecisionMs;                    // after the detection was started, unless it ends with the VM start
+    int expectVibrations;                    // -1 if it depends on the timing
+};
+
+static const Scenario scenarios[] = {
+    { "no key", 0, { { 0, 0 } },
+        false, 0, 0 },
+    { "key held, no presses", KEY_VOLUMEDOWN, { { 0, 0 } },
+        false, 5000, 2 },
+    { "wrong key", 0, { { 300, KEY_VOLUMEDOWN }, { 800, KEY_VOLUMEUP }, { 0, 0 } },
+        false, 800, 2 },
+    { "five presses", 0, { { 300, KEY_VOLUMEDOWN }, { 600, KEY_VOLUMEDOWN }, { 900, KEY_VOLUMEDOWN },
+                           { 1200, KEY_VOLUMEDOWN }, { 1500, KEY_VOLUMEDOWN }, { 0, 0 } },
+        true, 1500, -1 },
+};
+
+
+////////////////////////////////////////////////////////////
+// Fake input device
+////////////////////////////////////////////////////////////
+
+// Read by the detection process, which is forked after they have been set
+static int reportedKey = KEY_VOLUMEDOWN;
+static int heldKey = 0;
+
+extern "C" int __real_ioctl(int fd, unsigned long request, ...);
+
+static void setBit(int bit, void* buffer, size_t size) {
+    if ((size_t) bit / 8 < size)
+        ((uint8_t*) buffer)[bit / 8] |= 1 << (bit % 8);
+}
+
+/** Answers the evdev requests for the FIFO, everything else is passed on. */
+extern "C" int __wrap_ioctl(int fd, unsigned long request, ...) {
+    va_list args;
+    va_start(args, request);
+    void* arg = va_arg(args, void*);
+    va_end(args);
+
+    struct stat st;
+    if (_IOC_TYPE(request) != 'E' || fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode))
+        return __real_ioctl(fd, request, arg);
+
+    size_t size = _IOC_SIZE(request);
+    if (_IOC_NR(request) == _IOC_NR(EVIOCGBIT(EV_KEY, 0))) {
+        memset(arg, 0, size);
+        setBit(reportedKey, arg, size);
+        if (heldKey != 0)
+            setBit(heldKey, arg, size);
+        return size;
+    } else if (_IOC_NR(request) == _IOC_NR(EVIOCGNAME(0))) {
+        strlcpy((char*) arg, DEVICE_NAME, size);
+        return strlen((char*) arg) + 1;
+    } else if (_IOC_NR(request) == _IOC_NR(EVIOCGKEY(0))) {
+        memset(arg, 0, size);
+        if (heldKey != 0)
+            setBit(heldKey, arg, size);
+        return size;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+
+////////////////////////////////////////////////////////////
+// Scenarios
+////////////////////////////////////////////////////////////
+
+struct ScriptArgs {
+    int fd;
+    int64_t startMs;
+    const ScriptedKey* presses;
+};
+
+static int64_t monotonicMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void writeKey(int fd, int code, int value) {
+    struct input_event events[2];
+    memset(events, 0, sizeof(events));
+    events[0].type = EV_KEY;
+    events[0].code = code;
+    events[0].value = value;
+    events[1].type = EV_SYN;
+    events[1].code = SYN_REPORT;
+    if (TEMP_FAILURE_RETRY(write(fd, events, sizeof(events))) != sizeof(events))
+        ALOGE("Could not write input events: %s", strerror(errno));
+}
+
+/** Presses and releases the keys at the scripted times, relative to the start of the detection. */
+static void* scriptThread(void* arg) {
+    const ScriptArgs* script = (const ScriptArgs*) arg;
+    for (const ScriptedKey* key = script->presses; key->code != 0; key++) {
+        int64_t delayMs = script->startMs + key->timeMs - monotonicMs();
+        if (delayMs > 0)
+            usleep(delayMs * 1000);
+        writeKey(script->fd, key->code, 1);
+        writeKey(script->fd, key->code, 0);
+    }
+    return NULL;
+}
+
+/** Returns the number of vibrations and whether the last one was the long confirmation. */
+static int readVibrations(bool* longLast) {
+    *longLast = false;
+    FILE* fp = fopen(VIBRATOR_FILE, "r");
+    if (fp == NULL)
+        return -1;
+
+    int count = 0, duration;
+    while (fscanf(fp, "%d", &duration) == 1) {
+        count++;
+        *longLast = duration == VIBRATION_LONG;
+    }
+    fclose(fp);
+    return count;
+}
+
+static bool check(bool ok, const char* fmt, ...) {
+    if (!ok) {
+        va_list args;
+        va_start(args, fmt);
+        printf("    FAILED: ");
+        vprintf(fmt, args);
+        printf("\n");
+        va_end(args);
+    }
+    return ok;
+}
+
+static bool runScenario(const Scenario* scenario, int vmStartMs) {
+    unlink(DEVICE_FILE);
+    if (mkfifo(DEVICE_FILE, 0600) != 0) {
+        printf("Could not create %s: %s\n", DEVICE_FILE, strerror(errno));
+        return false;
+    }
+    int vibratorFd = open(VIBRATOR_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (vibratorFd >= 0)
+        close(vibratorFd);
+    unlink(XPOSED_ZYGOTE_STATE);
+
+    // Opened for writing without a reader, so the scripted events never block
+    int deviceFd = open(DEVICE_FILE, O_RDWR | O_CLOEXEC);
+    if (deviceFd < 0) {
+        printf("Could not open %s: %s\n", DEVICE_FILE, strerror(errno));
+        return false;
+    }
+
+    heldKey = scenario->heldKey;
+    int64_t startMs = monotonicMs();
+    if (!xposed::startSafemodeDetection(false)) {
+        printf("Could not start the safemode detection\n");
+        close(deviceFd);
+        return false;
+    }
+
+    ScriptArgs script = { deviceFd, startMs, scenario->presses };
+    pthread_t thread;
+    pthread_create(&thread, NULL, &scriptThread, &script);
+
+    // Zygote creates the VM meanwhile, checkSafemode() only waits for the rest of the detection
+    usleep(vmStartMs * 1000);
+    int64_t waitStartMs = monotonicMs();
+    bool triggered = xposed::waitForSafemodeResult();
+    int64_t delayMs = monotonicMs() - waitStartMs;
+
+    pthread_join(thread, NULL);
+    close(deviceFd);
+
+    // Without a held key, Zygote doesn't wait for the first press after the VM was created
+    bool endsWithVmStart = scenario->heldKey == 0
+        && (scenario->presses[0].code == 0 || scenario->presses[0].timeMs > vmStartMs);
+    bool expectTriggered = scenario->expectTriggered && !endsWithVmStart;
+    int expectVibrations = endsWithVmStart ? 0 : scenario->expectVibrations;
+    int expectDelayMs = endsWithVmStart ? 0 : scenario->expectDecisionMs - vmStartMs;
+    if (expectDelayMs < 0)
+        expectDelayMs = 0;
+    bool longLast;
+    int vibrations = readVibrations(&longLast);
+    xposed::ZygoteState state;
+    memset(&state, 0, sizeof(state));
+    int stateFd = open(XPOSED_ZYGOTE_STATE, O_RDONLY | O_CLOEXEC);
+    if (stateFd >= 0) {
+        TEMP_FAILURE_RETRY(read(stateFd, &state, sizeof(state)));
+        close(stateFd);
+    }
+
+    printf("  %-24s %-13s boot delayed by %5" PRId64 " ms (expected %4d), %d vibration(s)\n",
+        scenario->name, triggered ? "triggered" : "not triggered", delayMs, expectDelayMs, vibrations);
+
+    bool ok = true;
+    ok &= check(triggered == expectTriggered, "expected %s",
+        expectTriggered ? "triggered" : "not triggered");
+    ok &= check(llabs(delayMs - expectDelayMs) <= TOLERANCE_MS, "expected a boot delay of %d ms (+/- %d)",
+        expectDelayMs, TOLERANCE_MS);
+    ok &= check(expectVibrations < 0 || vibrations == expectVibrations,
+        "expected %d vibration(s)", expectVibrations);
+    ok &= check(longLast == expectTriggered, "expected %s long confirmation vibration",
+        expectTriggered ? "a" : "no");
+    bool sharedTriggered = (state.flags & xposed::ZYGOTE_STATE_SAFEMODE_TRIGGERED) != 0;
+    ok &= check((state.flags & xposed::ZYGOTE_STATE_SAFEMODE_DONE) && sharedTriggered == expectTriggered,
+        "expected the same result for the secondary Zygote");
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    int vmStartMs = 500;
+    bool verbose = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--vm-start") == 0 && i + 1 < argc) {
+            vmStartMs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = true;
+        } else {
+            fprintf(stderr, "Usage: safemode_scenarios [--vm-start <ms>] [--verbose]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    mkdir(XPOSED_HOST_ROOT, 0755);
+    mkdir(XPOSED_HOST_ROOT "/dev", 0755);
+    mkdir(SAFEMODE_DEVICE_PATH, 0755);
+    mkdir(XPOSED_CACHE_DIR, 0755);
+    if (!verbose) {
+        int fd = open(XPOSED_HOST_ROOT "/safemode_scenarios.log", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+    }
+
+    // Also remembers the arguments for setProcessName() in the detection process, like in app_main
+    xposed::handleOptions(argc, argv);
+    xposed::setSafemodeTestPaths(SAFEMODE_DEVICE_PATH, VIBRATOR_FILE);
+
+    printf("Safemode scenarios, VM start %d ms\n", vmStartMs);
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        if (!runScenario(&scenarios[i], vmStartMs))
+            failures++;
+    }
+    unlink(DEVICE_FILE);
+
+    printf("%s: %d of %zu scenario(s) failed\n", failures ? "FAILED" : "PASSED", failures,
+        sizeof(scenarios) / sizeof(scenarios[0]));
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
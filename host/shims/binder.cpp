@@ -0,0 +1,184 @@
+/**
+ * Host implementation of the binder classes. Each process has its own service manager,
+ * transactions to other processes succeed without doing anything.
+ */
+
+#include <binder/BpBinder.h>
+#include <binder/IInterface.h>
+#include <binder/IPCThreadState.h>
+#include <binder/IServiceManager.h>
+#include <binder/Parcel.h>
+#include <binder/ProcessState.h>
+
+#include <map>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace android {
+
+////////////////////////////////////////////////////////////
+// Binder objects
+////////////////////////////////////////////////////////////
+
+status_t BBinder::transact(uint32_t code, const Parcel& data, Parcel* reply, uint32_t flags) {
+    data.setDataPosition(0);
+    status_t err = onTransact(code, data, reply, flags);
+    if (reply != NULL)
+        reply->setDataPosition(0);
+    return err;
+}
+
+status_t BBinder::onTransact(uint32_t, const Parcel&, Parcel*, uint32_t) {
+    return UNKNOWN_TRANSACTION;
+}
+
+status_t BpBinder::transact(uint32_t, const Parcel&, Parcel*, uint32_t) {
+    return NO_ERROR;
+}
+
+
+////////////////////////////////////////////////////////////
+// Parcel
+////////////////////////////////////////////////////////////
+
+status_t Parcel::write(const void* buffer, size_t len) {
+    const uint8_t* bytes = (const uint8_t*) buffer;
+    data.insert(data.end(), bytes, bytes + len);
+    return NO_ERROR;
+}
+
+status_t Parcel::writeInt32(int32_t value) {
+    return write(&value, sizeof(value));
+}
+
+status_t Parcel::writeInt64(int64_t value) {
+    return write(&value, sizeof(value));
+}
+
+status_t Parcel::writeString16(const String16& str) {
+    writeInt32(str.utf8().size());
+    return write(str.utf8().data(), str.utf8().size());
+}
+
+status_t Parcel::writeStrongBinder(const sp<IBinder>& binder) {
+    IBinder* ptr = binder.get();
+    return write(&ptr, sizeof(ptr));
+}
+
+status_t Parcel::writeInterfaceToken(const String16& interface) {
+    return writeString16(interface);
+}
+
+status_t Parcel::writeNoException() {
+    return writeInt32(0);
+}
+
+status_t Parcel::read(void* buffer, size_t len) const {
+    if (len > dataAvail()) {
+        memset(buffer, 0, len);
+        pos = data.size();
+        return -ENODATA;
+    }
+    memcpy(buffer, &data[pos], len);
+    pos += len;
+    return NO_ERROR;
+}
+
+int32_t Parcel::readInt32() const {
+    int32_t value;
+    read(&value, sizeof(value));
+    return value;
+}
+
+int64_t Parcel::readInt64() const {
+    int64_t value;
+    read(&value, sizeof(value));
+    return value;
+}
+
+String16 Parcel::readString16() const {
+    int32_t len = readInt32();
+    if (len <= 0 || (size_t) len > dataAvail())
+        return String16();
+    String16 str((const char*) &data[pos], len);
+    pos += len;
+    return str;
+}
+
+sp<IBinder> Parcel::readStrongBinder() const {
+    IBinder* ptr;
+    read(&ptr, sizeof(ptr));
+    return ptr;
+}
+
+int32_t Parcel::readExceptionCode() const {
+    return readInt32();
+}
+
+bool Parcel::checkInterface(const String16& interface) const {
+    return readString16().utf8() == interface.utf8();
+}
+
+
+////////////////////////////////////////////////////////////
+// Service manager
+////////////////////////////////////////////////////////////
+
+static std::map<std::string, sp<IBinder> > services;
+static pthread_mutex_t servicesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+sp<IBinder> IServiceManager::checkService(const String16& name) const {
+    pthread_mutex_lock(&servicesMutex);
+    std::map<std::string, sp<IBinder> >::const_iterator it = services.find(name.utf8());
+    sp<IBinder> service = (it != services.end()) ? it->second : sp<IBinder>();
+    pthread_mutex_unlock(&servicesMutex);
+    return service;
+}
+
+sp<IBinder> IServiceManager::getService(const String16& name) const {
+    sp<IBinder> service = checkService(name);
+    return (service.get() != NULL) ? service : sp<IBinder>(new BpBinder());
+}
+
+status_t IServiceManager::addService(const String16& name, const sp<IBinder>& service, bool) {
+    pthread_mutex_lock(&servicesMutex);
+    services[name.utf8()] = service;
+    pthread_mutex_unlock(&servicesMutex);
+    return NO_ERROR;
+}
+
+sp<IServiceManager> defaultServiceManager() {
+    static IServiceManager* sm = new IServiceManager();
+    return sm;
+}
+
+
+////////////////////////////////////////////////////////////
+// Threads
+////////////////////////////////////////////////////////////
+
+IPCThreadState* IPCThreadState::self() {
+    static IPCThreadState* state = new IPCThreadState();
+    return state;
+}
+
+pid_t IPCThreadState::getCallingPid() const {
+    return getpid();
+}
+
+uid_t IPCThreadState::getCallingUid() const {
+    return getuid();
+}
+
+void IPCThreadState::joinThreadPool(bool) {
+    while (1)
+        pause();
+}
+
+sp<ProcessState> ProcessState::self() {
+    static ProcessState* state = new ProcessState();
+    return state;
+}
+
+}  // namespace android
@@ -0,0 +1,25 @@
+/**
+ * Host implementations of bionic functions which glibc lacks.
+ */
+
+#include <sys/capability.h>
+
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int capset(cap_user_header_t hdrp, const cap_user_data_t datap) {
+    return syscall(SYS_capset, hdrp, datap);
+}
+
+#if !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char* dst, const char* src, size_t size) {
+    size_t len = strlen(src);
+    if (size > 0) {
+        size_t copy = (len < size) ? len : size - 1;
+        memcpy(dst, src, copy);
+        dst[copy] = '\0';
+    }
+    return len;
+}
+#endif
@@ -0,0 +1,165 @@
+/**
+ * Host implementations of the libcutils and liblog functions used by the startup code.
+ */
+
+#include <cutils/ashmem.h>
+#include <cutils/log.h>
+#include <cutils/process_name.h>
+#include <cutils/properties.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <time.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////
+// Log
+////////////////////////////////////////////////////////////
+
+static const char priorityChars[] = "??VDIWEFS";
+
+int __android_log_print(int prio, const char* tag, const char* fmt, ...) {
+    char message[1024];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct tm tm;
+    localtime_r(&now.tv_sec, &tm);
+
+    // Same format as "logcat -v time", written at once so lines of different processes aren't mixed
+    char line[1200];
+    int len = snprintf(line, sizeof(line), "%02d-%02d %02d:%02d:%02d.%03ld %c/%s(%5d): %s\n",
+        tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, now.tv_nsec / 1000000,
+        (prio >= 0 && prio < (int) sizeof(priorityChars) - 1) ? priorityChars[prio] : '?',
+        (tag != NULL) ? tag : "", getpid(), message);
+    if (len >= (int) sizeof(line))
+        len = sizeof(line) - 1;
+    return write(STDERR_FILENO, line, len);
+}
+
+
+////////////////////////////////////////////////////////////
+// Properties
+////////////////////////////////////////////////////////////
+
+#define HOST_PROPERTIES_MAX 64
+
+struct HostProperty {
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+};
+
+static HostProperty properties[HOST_PROPERTIES_MAX];
+static int propertyCount = 0;
+static pthread_once_t propertiesLoaded = PTHREAD_ONCE_INIT;
+static pthread_mutex_t propertiesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static HostProperty* findProperty(const char* key) {
+    for (int i = 0; i < propertyCount; i++) {
+        if (strcmp(properties[i].key, key) == 0)
+            return &properties[i];
+    }
+    return NULL;
+}
+
+static bool storeProperty(const char* key, const char* value) {
+    HostProperty* property = findProperty(key);
+    if (property == NULL) {
+        if (propertyCount >= HOST_PROPERTIES_MAX || strlen(key) >= PROPERTY_KEY_MAX)
+            return false;
+        property = &properties[propertyCount++];
+        strlcpy(property->key, key, sizeof(property->key));
+    }
+    strlcpy(property->value, value, sizeof(property->value));
+    return true;
+}
+
+/** Reads the properties like build.prop, i.e. one key=value pair per line. */
+static void loadProperties() {
+    FILE* fp = fopen(XPOSED_HOST_PROPERTIES, "r");
+    if (fp == NULL)
+        return;
+
+    char line[PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX + 2];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char* value = strchr(line, '=');
+        if (line[0] == '#' || value == NULL)
+            continue;
+        *value++ = '\0';
+        storeProperty(line, value);
+    }
+    fclose(fp);
+}
+
+int property_get(const char* key, char* value, const char* default_value) {
+    pthread_once(&propertiesLoaded, loadProperties);
+    pthread_mutex_lock(&propertiesMutex);
+    HostProperty* property = findProperty(key);
+    const char* result = (property != NULL) ? property->value : default_value;
+    int len = 0;
+    if (result != NULL) {
+        len = strlcpy(value, result, PROPERTY_VALUE_MAX);
+        if (len >= PROPERTY_VALUE_MAX)
+            len = PROPERTY_VALUE_MAX - 1;
+    } else {
+        value[0] = '\0';
+    }
+    pthread_mutex_unlock(&propertiesMutex);
+    return len;
+}
+
+/** Only changes the properties of this process. */
+int property_set(const char* key, const char* value) {
+    pthread_once(&propertiesLoaded, loadProperties);
+    pthread_mutex_lock(&propertiesMutex);
+    bool success = strlen(value) < PROPERTY_VALUE_MAX && storeProperty(key, value);
+    pthread_mutex_unlock(&propertiesMutex);
+    return success ? 0 : -1;
+}
+
+
+////////////////////////////////////////////////////////////
+// Ashmem
+////////////////////////////////////////////////////////////
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+int ashmem_create_region(const char* name, size_t size) {
+    int fd = memfd_create(name, MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return -1;
+
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/** Like the ashmem protection mask, this only affects new mappings of the region. */
+int ashmem_set_prot_region(int fd, int prot) {
+    if (prot & PROT_WRITE)
+        return 0;
+    return fcntl(fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE);
+}
+
+
+////////////////////////////////////////////////////////////
+// Process name
+////////////////////////////////////////////////////////////
+
+void set_process_name(const char* process_name) {
+    prctl(PR_SET_NAME, process_name, 0, 0, 0);
+}
@@ -0,0 +1,309 @@
+/**
+ * Runs the startup code of the primary Zygote on the host and reports how long each phase of
+ * the timeline takes. All paths are redirected to XPOSED_HOST_ROOT, the services are started
+ * as helper processes of this executable, and the VM start is simulated with a fixed delay.
+ *
+ * Usage: startup_timing [--selinux] [--nodelay] [--cold] [--runs <n>] [--vm-start <ms>] [--verbose]
+ */
+
+#define LOG_TAG "Xposed"
+
+#include "xposed.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#define MAX_RUNS 100
+
+struct Options {
+    bool selinux;
+    bool nodelay;
+    bool cold;
+    bool verbose;
+    int runs;
+    int vmStartMs;
+};
+
+struct PhaseStats {
+    std::string name;
+    int depth;
+    int count;
+    int64_t totalUs;
+    int64_t minUs;
+    int64_t maxUs;
+};
+
+static int64_t monotonicUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: startup_timing [--selinux] [--nodelay] [--cold] [--runs <n>] [--vm-start <ms>] [--verbose]\n");
+    exit(EXIT_FAILURE);
+}
+
+static bool parseOptions(int argc, char* argv[], Options* options) {
+    memset(options, 0, sizeof(*options));
+    options->runs = 5;
+    options->vmStartMs = 500;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--selinux") == 0) {
+            options->selinux = true;
+        } else if (strcmp(argv[i], "--nodelay") == 0) {
+            options->nodelay = true;
+        } else if (strcmp(argv[i], "--cold") == 0) {
+            options->cold = true;
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            options->verbose = true;
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            options->runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--vm-start") == 0 && i + 1 < argc) {
+            options->vmStartMs = atoi(argv[++i]);
+        } else {
+            return false;
+        }
+    }
+    return options->runs > 0 && options->runs <= MAX_RUNS && options->vmStartMs >= 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Fake system
+////////////////////////////////////////////////////////////
+
+static void makeDirs(const char* path) {
+    char buf[PATH_MAX];
+    strlcpy(buf, path, sizeof(buf));
+    for (char* p = buf + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        mkdir(buf, 0755);
+        *p = '/';
+    }
+    mkdir(buf, 0755);
+}
+
+static void writeFile(const char* path, const char* content, mode_t mode = 0644) {
+    std::string dir(path);
+    makeDirs(dir.substr(0, dir.rfind('/')).c_str());
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fputs(content, fp);
+    fclose(fp);
+    chmod(path, mode);
+}
+
+static void clearCache() {
+    unlink(XPOSED_ZYGOTE_STATE);
+    unlink(XPOSED_INSTALLER_CACHE);
+    unlink(XPOSED_SAFEMODE_DEVICES);
+    unlink(XPOSED_TIMELINE_FILE);
+}
+
+/** Creates the files that the startup code expects on a device. */
+static void prepareRoot(const Options* options) {
+    makeDirs(XPOSED_CONF_DIR);
+    makeDirs(XPOSED_DIR "log");
+    makeDirs(XPOSED_CACHE_DIR);
+    makeDirs(SAFEMODE_DEVICE_PATH);
+    clearCache();
+
+    writeFile(XPOSED_PROP_FILE, "version=89\narch=host\nminsdk=24\nmaxsdk=24\n");
+    writeFile(XPOSED_JAR, "");
+    writeFile(XPOSED_HOST_PROPERTIES,
+        "ro.build.version.release=7.0\n"
+        "ro.build.version.sdk=24\n"
+        "ro.product.manufacturer=Host\n"
+        "ro.product.model=startup_timing\n"
+        "ro.build.display.id=host\n"
+        "ro.build.fingerprint=host/startup_timing\n"
+        "ro.product.cpu.abi=host\n");
+    writeFile(XPOSEDLOG_LOGCAT,
+        "#!/bin/sh\n"
+        "echo '--------- beginning of main'\n"
+        "echo 'I/Xposed  (    1): Fake logcat started'\n"
+        "exec sleep 3600\n", 0755);
+
+    if (options->nodelay)
+        writeFile(XPOSED_SAFEMODE_NODELAY, "");
+    else
+        unlink(XPOSED_SAFEMODE_NODELAY);
+}
+
+
+////////////////////////////////////////////////////////////
+// Runs
+////////////////////////////////////////////////////////////
+
+/** Does what app_main.cpp does for the primary Zygote, with a simulated VM start. */
+static void runZygote(int argc, char* argv[], const Options* options) {
+    if (!xposed::handleOptions(argc, argv)
+            && xposed::initialize(true, true, NULL, argc, argv, argc)) {
+        if (dlopen(XPOSED_LIB_DIR "libart.so", RTLD_NOW) == NULL) {
+            ALOGE("Could not load the runtime library: %s", dlerror());
+            _exit(EXIT_FAILURE);
+        }
+        usleep(options->vmStartMs * 1000);
+        xposed::onVmCreated(NULL);
+        _exit(EXIT_SUCCESS);
+    }
+    _exit(EXIT_FAILURE);
+}
+
+/** Kills the helpers which were started by a run, they never exit by themselves. */
+static void killProcessGroup(pid_t pgid) {
+    kill(-pgid, SIGKILL);
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR) {}
+}
+
+static int64_t runOnce(int run, int argc, char* argv[], const Options* options) {
+    if (options->cold)
+        clearCache();
+    unlink(XPOSED_TIMELINE_FILE);
+
+    int64_t start = monotonicUs();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    } else if (pid == 0) {
+        setpgid(0, 0);
+        if (!options->verbose) {
+            char logFile[PATH_MAX];
+            snprintf(logFile, sizeof(logFile), "%s/run%d.log", XPOSED_HOST_ROOT, run);
+            int fd = open(logFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd >= 0) {
+                dup2(fd, STDERR_FILENO);
+                close(fd);
+            }
+        }
+        runZygote(argc, argv, options);
+    }
+
+    setpgid(pid, pid);
+    int status;
+    TEMP_FAILURE_RETRY(waitpid(pid, &status, 0));
+    int64_t duration = monotonicUs() - start;
+    killProcessGroup(pid);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "Run %d failed, see %s/run%d.log\n", run, XPOSED_HOST_ROOT, run);
+        exit(EXIT_FAILURE);
+    }
+    return duration;
+}
+
+/** Adds the phases of XPOSED_TIMELINE_FILE, nested phases are contained in earlier ones. */
+static void readTimeline(std::vector<PhaseStats>* phases) {
+    FILE* fp = fopen(XPOSED_TIMELINE_FILE, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not read %s: %s\n", XPOSED_TIMELINE_FILE, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<int64_t> openEnds;
+    char line[256];
+    char name[128];
+    long long startUs, durationUs;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%127s %lld %lld", name, &startUs, &durationUs) != 3)
+            continue;
+
+        while (!openEnds.empty() && openEnds.back() <= startUs)
+            openEnds.pop_back();
+        int depth = openEnds.size();
+        if (durationUs >= 0)
+            openEnds.push_back(startUs + durationUs);
+        else
+            durationUs = 0;
+
+        PhaseStats* phase = NULL;
+        for (size_t i = 0; i < phases->size(); i++) {
+            if ((*phases)[i].name == name && (*phases)[i].depth == depth)
+                phase = &(*phases)[i];
+        }
+        if (phase == NULL) {
+            PhaseStats newPhase = { name, depth, 0, 0, INT64_MAX, 0 };
+            phases->push_back(newPhase);
+            phase = &phases->back();
+        }
+        phase->count++;
+        phase->totalUs += durationUs;
+        if (durationUs < phase->minUs)
+            phase->minUs = durationUs;
+        if (durationUs > phase->maxUs)
+            phase->maxUs = durationUs;
+    }
+    fclose(fp);
+}
+
+static void printRow(const char* name, int depth, int count, int64_t totalUs, int64_t minUs, int64_t maxUs) {
+    printf("%*s%-*s %6d %10.2f %10.2f %10.2f\n", depth * 2, "", 28 - depth * 2, name, count,
+        totalUs / (count * 1000.0), minUs / 1000.0, maxUs / 1000.0);
+}
+
+int main(int argc, char* argv[]) {
+    // The services are started by executing this binary again
+    if (argc >= 2 && strcmp(argv[1], XPOSED_HELPER_OPTION) == 0) {
+        xposed::handleOptions(argc, argv);
+        return EXIT_FAILURE;
+    }
+
+    Options options;
+    if (!parseOptions(argc, argv, &options))
+        usage();
+
+    if (options.selinux)
+        setenv("XPOSED_HOST_SELINUX", "permissive", 1);
+    else
+        unsetenv("XPOSED_HOST_SELINUX");
+
+    prepareRoot(&options);
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) != 0) {
+        perror("prctl(PR_SET_CHILD_SUBREAPER)");
+        return EXIT_FAILURE;
+    }
+
+    std::vector<PhaseStats> phases;
+    int64_t totalUs = 0, minUs = INT64_MAX, maxUs = 0;
+    for (int run = 0; run < options.runs; run++) {
+        int64_t duration = runOnce(run, argc, argv, &options);
+        readTimeline(&phases);
+        totalUs += duration;
+        if (duration < minUs)
+            minUs = duration;
+        if (duration > maxUs)
+            maxUs = duration;
+    }
+
+    printf("Startup of the primary Zygote, %d %s run(s), SELinux %s, safemode delay %s, VM start %d ms\n\n",
+        options.runs, options.cold ? "cold" : "warm", options.selinux ? "permissive" : "disabled",
+        options.nodelay ? "skipped" : "enabled", options.vmStartMs);
+    printf("%-28s %6s %10s %10s %10s\n", "phase", "count", "mean ms", "min ms", "max ms");
+    for (size_t i = 0; i < phases.size(); i++) {
+        const PhaseStats& phase = phases[i];
+        printRow(phase.name.c_str(), phase.depth, phase.count, phase.totalUs, phase.minUs, phase.maxUs);
+    }
+    printRow("total (incl. VM start)", 0, options.runs, totalUs, minUs, maxUs);
+    return EXIT_SUCCESS;
+}
@@ -23,10 +23,19 @@
 #include "reflection.h"
 #include "scoped_thread_state_change.h"
 #include "well_known_classes.h"
+#if PLATFORM_SDK_VERSION >= 23
+#include "base/time_utils.h"
+#else
+#include "utils.h"
+#endif
 
 #if PLATFORM_SDK_VERSION >= 24
 #include "mirror/abstract_method.h"
+#include "oat_quick_method_header.h"
+#include "stack.h"
 #include "thread_list.h"
+#include <pthread.h>
+#include <vector>
 #endif
 
 using namespace art;
@@ -71,6 +80,119 @@ void logExceptionStackTrace() {
 #endif
 }
 
+#if PLATFORM_SDK_VERSION >= 24
+////////////////////////////////////////////////////////////
+// Caller invalidation
+////////////////////////////////////////////////////////////
+
+// Callers of hooked methods are invalidated in batches, as each flush has to suspend all threads.
+// hookMethodsNative() flushes once per batch. Single invalidations are only queued in Zygote,
+// where the queue is flushed explicitly, before forking and when it has reached this size.
+#define INVALIDATION_QUEUE_LIMIT 512
+
+static std::vector<ArtMethod*> gPendingInvalidations;
+static pthread_mutex_t gPendingInvalidationsMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t gSuspendAllCount = 0;
+static uint64_t gSuspendAllTotalNs = 0;
+
+/**
+ * Finds frames which might have to be deoptimized: hooked methods and compiled code which is
+ * no longer the entry point of its method, e.g. because its callers have been invalidated.
+ * Inlined frames are skipped, the compiled code of the outer method is checked instead.
+ */
+class AffectedFrameVisitor : public StackVisitor {
+  public:
+    explicit AffectedFrameVisitor(Thread* thread) SHARED_REQUIRES(Locks::mutator_lock_)
+        : StackVisitor(thread, nullptr, StackVisitor::StackWalkKind::kSkipInlinedFrames),
+          affected(false) {}
+
+    bool VisitFrame() OVERRIDE SHARED_REQUIRES(Locks::mutator_lock_) {
+        ArtMethod* method = GetMethod();
+        if (method == nullptr || method->IsRuntimeMethod() || method->IsNative()) {
+            return true;
+        }
+        if (method->IsXposedHookedMethod()) {
+            affected = true;
+            return false;
+        }
+        if (GetCurrentQuickFrame() != nullptr) {
+            const OatQuickMethodHeader* header = GetCurrentOatQuickMethodHeader();
+            const void* entryPoint = method->GetEntryPointFromQuickCompiledCode();
+            if (header == nullptr || !header->Contains(reinterpret_cast<uintptr_t>(entryPoint))) {
+                affected = true;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool affected;
+};
+
+struct InstrumentedThreads {
+    size_t total;
+    size_t instrumented;
+};
+
+/** Instrument the stacks of threads which are executing hooked methods or invalidated code. */
+static void instrumentThreadStacks(ScopedObjectAccess& soa, InstrumentedThreads* threads) {
+    auto* runtime = Runtime::Current();
+    ScopedThreadSuspension sts(soa.Self(), kSuspended);
+    ScopedSuspendAll ssa(__FUNCTION__);
+    MutexLock mu(soa.Self(), *Locks::thread_list_lock_);
+    runtime->GetThreadList()->ForEach([](Thread* thread, void* arg) SHARED_REQUIRES(Locks::mutator_lock_) {
+        InstrumentedThreads* threads = reinterpret_cast<InstrumentedThreads*>(arg);
+        threads->total++;
+        AffectedFrameVisitor visitor(thread);
+        visitor.WalkStack();
+        if (visitor.affected) {
+            threads->instrumented++;
+            Runtime::Current()->GetInstrumentation()->InstrumentThreadStack(thread);
+        }
+    }, threads);
+}
+
+static void flushInvalidations(ScopedObjectAccess& soa) {
+    // The mutex must not be held while other threads are suspended, they might be waiting for it.
+    std::vector<ArtMethod*> methods;
+    pthread_mutex_lock(&gPendingInvalidationsMutex);
+    methods.swap(gPendingInvalidations);
+    pthread_mutex_unlock(&gPendingInvalidationsMutex);
+    if (methods.empty()) {
+        return;
+    }
+
+    auto* cl = Runtime::Current()->GetClassLinker();
+    for (ArtMethod* method : methods) {
+        cl->InvalidateCallersForMethod(soa.Self(), method);
+    }
+
+    InstrumentedThreads threads = { 0, 0 };
+    uint64_t start = NanoTime();
+    instrumentThreadStacks(soa, &threads);
+    uint64_t duration = NanoTime() - start;
+
+    pthread_mutex_lock(&gPendingInvalidationsMutex);
+    uint32_t count = ++gSuspendAllCount;
+    uint64_t totalNs = (gSuspendAllTotalNs += duration);
+    pthread_mutex_unlock(&gPendingInvalidationsMutex);
+
+    XLOG(INFO) << "Invalidated callers of " << methods.size() << " methods, suspend-all #" << count
+               << " took " << duration / 1000 << " us (" << totalNs / 1000 << " us in total), instrumented "
+               << threads.instrumented << " of " << threads.total << " threads";
+}
+
+static void queueInvalidation(ScopedObjectAccess& soa, ArtMethod* method) {
+    pthread_mutex_lock(&gPendingInvalidationsMutex);
+    gPendingInvalidations.push_back(method);
+    bool full = gPendingInvalidations.size() >= INVALIDATION_QUEUE_LIMIT;
+    pthread_mutex_unlock(&gPendingInvalidationsMutex);
+    if (full) {
+        flushInvalidations(soa);
+    }
+}
+#endif
+
 ////////////////////////////////////////////////////////////
 // JNI methods
 ////////////////////////////////////////////////////////////
@@ -95,6 +217,81 @@ void XposedBridge_hookMethodNative(JNIEnv* env, jclass, jobject javaReflectedMet
     artMethod->EnableXposedHook(soa, javaAdditionalInfo);
 }
 
+void XposedBridge_hookMethodsNative(JNIEnv* env, jclass, jobjectArray javaMethods,
+            jobjectArray javaAdditionalInfos) {
+    uint64_t start = NanoTime();
+    ScopedObjectAccess soa(env);
+    if (javaMethods == nullptr || javaAdditionalInfos == nullptr) {
+#if PLATFORM_SDK_VERSION >= 23
+        ThrowIllegalArgumentException("methods and additionalInfos must not be null");
+#else
+        ThrowIllegalArgumentException(nullptr, "methods and additionalInfos must not be null");
+#endif
+        return;
+    }
+
+    // Hooking can cause a GC, so the arrays must not be referenced by raw pointers.
+    StackHandleScope<2> hs(soa.Self());
+    Handle<mirror::ObjectArray<mirror::Object>> methods(hs.NewHandle(
+        soa.Decode<mirror::ObjectArray<mirror::Object>*>(javaMethods)));
+    Handle<mirror::ObjectArray<mirror::Object>> infos(hs.NewHandle(
+        soa.Decode<mirror::ObjectArray<mirror::Object>*>(javaAdditionalInfos)));
+    size_t count = methods->GetLength();
+    if (static_cast<size_t>(infos->GetLength()) != count) {
+#if PLATFORM_SDK_VERSION >= 23
+        ThrowIllegalArgumentException("methods and additionalInfos must have the same length");
+#else
+        ThrowIllegalArgumentException(nullptr, "methods and additionalInfos must have the same length");
+#endif
+        return;
+    }
+
+    // Hook all methods while holding the mutator lock only once.
+    // The local references are released immediately, batches can be larger than the reference table.
+    size_t hooked = 0;
+    for (size_t i = 0; i < count; i++) {
+        mirror::Object* method = methods->Get(i);
+        if (method == nullptr) {
+#if PLATFORM_SDK_VERSION >= 23
+            ThrowIllegalArgumentException("method must not be null");
+#else
+            ThrowIllegalArgumentException(nullptr, "method must not be null");
+#endif
+            break;
+        }
+        jobject javaReflectedMethod = soa.AddLocalReference<jobject>(method);
+        ArtMethod* artMethod = ArtMethod::FromReflectedMethod(soa, javaReflectedMethod);
+        if (artMethod->IsXposedHookedMethod()) {
+            env->DeleteLocalRef(javaReflectedMethod);
+            continue;
+        }
+        jobject javaAdditionalInfo = soa.AddLocalReference<jobject>(infos->Get(i));
+        artMethod->EnableXposedHook(soa, javaAdditionalInfo);
+        env->DeleteLocalRef(javaAdditionalInfo);
+        env->DeleteLocalRef(javaReflectedMethod);
+        if (soa.Self()->IsExceptionPending()) {
+            break;
+        }
+        hooked++;
+#if PLATFORM_SDK_VERSION >= 24
+        queueInvalidation(soa, artMethod);
+#endif
+    }
+
+    if (soa.Self()->IsExceptionPending()) {
+        // Suspending all threads isn't allowed with a pending exception. The methods hooked so far
+        // stay queued and are invalidated with the next flush.
+        return;
+    }
+
+#if PLATFORM_SDK_VERSION >= 24
+    // The hooks must be effective when this returns, so invalidate the callers of the whole batch now.
+    flushInvalidations(soa);
+#endif
+
+    XLOG(INFO) << "Hooked " << hooked << " of " << count << " methods in " << (NanoTime() - start) / 1000 << " us";
+}
+
 jobject XposedBridge_invokeOriginalMethodNative(JNIEnv* env, jclass, jobject javaMethod,
             jint isResolved, jobjectArray, jclass, jobject javaReceiver, jobjectArray javaArgs) {
     ScopedFastNativeObjectAccess soa(env);
@@ -111,6 +308,159 @@ jobject XposedBridge_invokeOriginalMethodNative(JNIEnv* env, jclass, jobject jav
 #endif
 }
 
+/**
+ * Returns a handle for invokeOriginalMethodRawNative(), which refers to the original code of hooked methods.
+ * Hooks modify the method in place, so a handle resolved before the method is hooked invokes the hook.
+ */
+jlong XposedBridge_resolveOriginalMethodNative(JNIEnv* env, jclass, jobject javaMethod) {
+    ScopedObjectAccess soa(env);
+    if (javaMethod == nullptr) {
+#if PLATFORM_SDK_VERSION >= 23
+        ThrowIllegalArgumentException("method must not be null");
+#else
+        ThrowIllegalArgumentException(nullptr, "method must not be null");
+#endif
+        return 0;
+    }
+
+    ArtMethod* artMethod = ArtMethod::FromReflectedMethod(soa, javaMethod);
+    if (artMethod->IsXposedHookedMethod()) {
+        artMethod = ArtMethod::FromReflectedMethod(soa, artMethod->GetXposedHookInfo()->reflected_method);
+    }
+    return static_cast<jlong>(reinterpret_cast<uintptr_t>(artMethod));
+}
+
+/**
+ * Calls a method resolved with resolveOriginalMethodNative() without boxing and type checks.
+ * Arguments and the result are passed as raw values (float and double as their bits),
+ * only methods without references in their parameters and return type are supported.
+ */
+jlong XposedBridge_invokeOriginalMethodRawNative(JNIEnv* env, jclass, jlong handle,
+            jobject javaReceiver, jlongArray javaArgs) {
+    ScopedFastNativeObjectAccess soa(env);
+    ArtMethod* method = reinterpret_cast<ArtMethod*>(static_cast<uintptr_t>(handle));
+    if (UNLIKELY(method == nullptr)) {
+#if PLATFORM_SDK_VERSION >= 23
+        ThrowIllegalArgumentException("invalid method handle");
+#else
+        ThrowIllegalArgumentException(nullptr, "invalid method handle");
+#endif
+        return 0;
+    }
+    uint32_t shortyLength;
+    const char* shorty = method->GetShorty(&shortyLength);
+    if (UNLIKELY(shorty[0] == 'L' || shorty[0] == '[')) {
+#if PLATFORM_SDK_VERSION >= 23
+        ThrowIllegalArgumentException("reference return types are not supported");
+#else
+        ThrowIllegalArgumentException(nullptr, "reference return types are not supported");
+#endif
+        return 0;
+    }
+
+    // Initializing the class might cause a GC, so decode the other objects only afterwards
+    if (method->IsStatic()) {
+        StackHandleScope<1> hs(soa.Self());
+        Handle<mirror::Class> clazz(hs.NewHandle(method->GetDeclaringClass()));
+        if (UNLIKELY(!clazz->IsInitialized())) {
+#if PLATFORM_SDK_VERSION >= 23
+            if (!Runtime::Current()->GetClassLinker()->EnsureInitialized(soa.Self(), clazz, true, true)) {
+#else
+            if (!Runtime::Current()->GetClassLinker()->EnsureInitialized(clazz, true, true)) {
+#endif
+                return 0;
+            }
+        }
+    }
+
+    auto* args = soa.Decode<mirror::LongArray*>(javaArgs);
+    uint32_t argCount = (args != nullptr) ? args->GetLength() : 0;
+    if (UNLIKELY(argCount != shortyLength - 1)) {
+#if PLATFORM_SDK_VERSION >= 23
+        ThrowIllegalArgumentException("wrong number of arguments");
+#else
+        ThrowIllegalArgumentException(nullptr, "wrong number of arguments");
+#endif
+        return 0;
+    }
+
+    // Methods can't have more than 255 argument slots, including the receiver
+    uint32_t values[256];
+    uint32_t count = 0;
+    if (!method->IsStatic()) {
+        mirror::Object* receiver = soa.Decode<mirror::Object*>(javaReceiver);
+        if (UNLIKELY(receiver == nullptr)) {
+#if PLATFORM_SDK_VERSION >= 23
+            ThrowNullPointerException("null receiver");
+#else
+            ThrowNullPointerException(nullptr, "null receiver");
+#endif
+            return 0;
+        }
+        if (UNLIKELY(!receiver->InstanceOf(method->GetDeclaringClass()))) {
+#if PLATFORM_SDK_VERSION >= 23
+            ThrowIllegalArgumentException("receiver is not an instance of the declaring class");
+#else
+            ThrowIllegalArgumentException(nullptr, "receiver is not an instance of the declaring class");
+#endif
+            return 0;
+        }
+        values[count++] = StackReference<mirror::Object>::FromMirrorPtr(receiver).AsVRegValue();
+    }
+    for (uint32_t i = 0; i < argCount; i++) {
+        int64_t value = args->Get(i);
+        switch (shorty[i + 1]) {
+            case 'J':
+            case 'D':
+                values[count++] = static_cast<uint32_t>(value);
+                values[count++] = static_cast<uint32_t>(value >> 32);
+                break;
+            case 'Z':
+                values[count++] = (value != 0) ? 1 : 0;
+                break;
+            // Narrow values like the interpreter expects them in the argument slots
+            case 'B':
+                values[count++] = static_cast<uint32_t>(static_cast<int32_t>(static_cast<int8_t>(value)));
+                break;
+            case 'C':
+                values[count++] = static_cast<uint16_t>(value);
+                break;
+            case 'S':
+                values[count++] = static_cast<uint32_t>(static_cast<int32_t>(static_cast<int16_t>(value)));
+                break;
+            case 'L':
+            case '[':
+#if PLATFORM_SDK_VERSION >= 23
+                ThrowIllegalArgumentException("reference parameters are not supported");
+#else
+                ThrowIllegalArgumentException(nullptr, "reference parameters are not supported");
+#endif
+                return 0;
+            default:
+                values[count++] = static_cast<uint32_t>(value);
+                break;
+        }
+    }
+
+    JValue result;
+    method->Invoke(soa.Self(), values, count * sizeof(uint32_t), &result, shorty);
+    if (soa.Self()->IsExceptionPending()) {
+        return 0;
+    }
+
+    switch (shorty[0]) {
+        case 'Z': return result.GetZ();
+        case 'B': return result.GetB();
+        case 'C': return result.GetC();
+        case 'S': return result.GetS();
+        case 'I': return result.GetI();
+        case 'F': return static_cast<uint32_t>(result.GetI());
+        case 'J':
+        case 'D': return result.GetJ();
+        default: return 0;
+    }
+}
+
 void XposedBridge_setObjectClassNative(JNIEnv* env, jclass, jobject javaObj, jclass javaClazz) {
     ScopedObjectAccess soa(env);
     StackHandleScope<3> hs(soa.Self());
@@ -170,7 +520,14 @@ jint XposedBridge_getRuntime(JNIEnv*, jclass) {
 #if PLATFORM_SDK_VERSION >= 21
 static FileDescriptorTable* gClosedFdTable = NULL;
 
-void XposedBridge_closeFilesBeforeForkNative(JNIEnv*, jclass) {
+void XposedBridge_closeFilesBeforeForkNative(JNIEnv* env __attribute__((unused)), jclass) {
+#if PLATFORM_SDK_VERSION >= 24
+    // The child must not inherit callers of hooked methods which haven't been invalidated
+    {
+        ScopedObjectAccess soa(env);
+        flushInvalidations(soa);
+    }
+#endif
     gClosedFdTable = FileDescriptorTable::Create();
 }
 
@@ -184,10 +541,6 @@ void XposedBridge_reopenFilesAfterForkNative(JNIEnv*, jclass) {
 #if PLATFORM_SDK_VERSION >= 24
 void XposedBridge_invalidateCallersNative(JNIEnv* env, jclass, jobjectArray javaMethods) {
     ScopedObjectAccess soa(env);
-    auto* runtime = Runtime::Current();
-    auto* cl = runtime->GetClassLinker();
-
-    // Invalidate callers of the given methods.
     auto* abstract_methods = soa.Decode<mirror::ObjectArray<mirror::AbstractMethod>*>(javaMethods);
     size_t count = abstract_methods->GetLength();
     for (size_t i = 0; i < count; i++) {
@@ -195,17 +548,18 @@ void XposedBridge_invalidateCallersNative(JNIEnv* env, jclass, jobjectArray java
         if (abstract_method == nullptr) {
             continue;
         }
-        ArtMethod* method = abstract_method->GetArtMethod();
-        cl->InvalidateCallersForMethod(soa.Self(), method);
+        queueInvalidation(soa, abstract_method->GetArtMethod());
     }
 
-    // Now instrument the stack to deoptimize methods which are being called right now.
-    ScopedThreadSuspension sts(soa.Self(), kSuspended);
-    ScopedSuspendAll ssa(__FUNCTION__);
-    MutexLock mu(soa.Self(), *Locks::thread_list_lock_);
-    runtime->GetThreadList()->ForEach([](Thread* thread, void*) SHARED_REQUIRES(Locks::mutator_lock_) {
-        Runtime::Current()->GetInstrumentation()->InstrumentThreadStack(thread);
-    }, nullptr);
+    // Nothing would flush the queue in other processes, e.g. for hooks installed after the fork.
+    if (!Runtime::Current()->IsZygote()) {
+        flushInvalidations(soa);
+    }
+}
+
+void XposedBridge_flushInvalidationsNative(JNIEnv* env, jclass) {
+    ScopedObjectAccess soa(env);
+    flushInvalidations(soa);
 }
 #endif
 
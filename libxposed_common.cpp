@@ -43,24 +43,6 @@ static int register_natives_XResources(JNIEnv* env, jclass clazz);
 static int register_natives_ZygoteService(JNIEnv* env, jclass clazz);
 
 
-////////////////////////////////////////////////////////////
-// Utility methods
-////////////////////////////////////////////////////////////
-
-/** Read an integer value from a configuration file. */
-int readIntConfig(const char* fileName, int defaultValue) {
-    FILE *fp = fopen(fileName, "r");
-    if (fp == NULL)
-        return defaultValue;
-
-    int result;
-    int success = fscanf(fp, "%i", &result);
-    fclose(fp);
-
-    return (success >= 1) ? result : defaultValue;
-}
-
-
 ////////////////////////////////////////////////////////////
 // Library initialization
 ////////////////////////////////////////////////////////////
@@ -148,6 +130,9 @@ void onVmCreatedCommon(JNIEnv* env) {
 ////////////////////////////////////////////////////////////
 
 jboolean XposedBridge_hadInitErrors(JNIEnv*, jclass) {
+    // This is called before the modules are loaded, so it's the last chance to apply safemode
+    if (xposedLoadedSuccessfully && xposed->checkSafemode != NULL && xposed->checkSafemode())
+        xposedLoadedSuccessfully = false;
     return !xposedLoadedSuccessfully;
 }
 
@@ -163,6 +148,51 @@ jint XposedBridge_getXposedVersion(JNIEnv*, jclass) {
     return xposed->xposedVersionInt;
 }
 
+/** Check the process filter prepared by Xposed Installer, called by the bridge after each fork. */
+jboolean XposedBridge_shouldSkipModulesNative(JNIEnv* env, jclass, jint uid, jstring processNameJ) {
+    const ProcessFilterHeader* filter = xposed->processFilter;
+    if (filter == NULL)
+        return false;
+
+    // The same filter applies to all users
+    uint32_t appId = ((uint32_t) uid) % 100000;
+    const uint32_t* appIds = (const uint32_t*) (filter + 1);
+    bool listed = false;
+    int low = 0, high = filter->appIdCount - 1;
+    while (low <= high && !listed) {
+        int mid = (low + high) / 2;
+        if (appIds[mid] < appId)
+            low = mid + 1;
+        else if (appIds[mid] > appId)
+            high = mid - 1;
+        else
+            listed = true;
+    }
+
+    if (!listed && processNameJ != NULL && filter->nameCount > 0) {
+        ScopedUtfChars processName(env, processNameJ);
+        const uint32_t* nameOffsets = appIds + filter->appIdCount;
+        const char* names = (const char*) (nameOffsets + filter->nameCount);
+        low = 0;
+        high = filter->nameCount - 1;
+        while (low <= high && !listed) {
+            int mid = (low + high) / 2;
+            int cmp = strcmp(names + nameOffsets[mid], processName.c_str());
+            if (cmp < 0)
+                low = mid + 1;
+            else if (cmp > 0)
+                high = mid - 1;
+            else
+                listed = true;
+        }
+    }
+
+    if (filter->flags & PROCESS_FILTER_ALLOWLIST)
+        return !listed;
+    else
+        return listed;
+}
+
 jboolean XposedBridge_initXResourcesNative(JNIEnv* env, jclass) {
     classXResources = env->FindClass(CLASS_XRESOURCES);
     if (classXResources == NULL) {
@@ -334,6 +364,30 @@ jbyteArray ZygoteService_readFile(JNIEnv* env, jclass, jstring filenameJ) {
 // JNI methods registrations
 ////////////////////////////////////////////////////////////
 
+/**
+ * Natives which older versions of XposedBridge don't declare. They are registered one by one,
+ * so a missing method doesn't prevent the others from being registered.
+ */
+static void register_optional_natives_XposedBridge(JNIEnv* env, jclass clazz) {
+    const JNINativeMethod methods[] = {
+        NATIVE_METHOD(XposedBridge, shouldSkipModulesNative, "(ILjava/lang/String;)Z"),
+        NATIVE_METHOD(XposedBridge, hookMethodsNative, "([Ljava/lang/reflect/Member;[Ljava/lang/Object;)V"),
+        NATIVE_METHOD(XposedBridge, resolveOriginalMethodNative, "(Ljava/lang/reflect/Member;)J"),
+#if PLATFORM_SDK_VERSION >= 21
+        NATIVE_METHOD(XposedBridge, invokeOriginalMethodRawNative, "!(JLjava/lang/Object;[J)J"),
+#endif
+#if PLATFORM_SDK_VERSION >= 24
+        NATIVE_METHOD(XposedBridge, flushInvalidationsNative, "()V"),
+#endif
+    };
+    for (int i = 0; i < NELEM(methods); i++) {
+        if (env->RegisterNatives(clazz, &methods[i], 1) != JNI_OK) {
+            ALOGD("%s.%s() is not declared, not registering it", CLASS_XPOSED_BRIDGE, methods[i].name);
+            env->ExceptionClear();
+        }
+    }
+}
+
 int register_natives_XposedBridge(JNIEnv* env, jclass clazz) {
     const JNINativeMethod methods[] = {
         NATIVE_METHOD(XposedBridge, hadInitErrors, "()Z"),
@@ -357,7 +411,10 @@ int register_natives_XposedBridge(JNIEnv* env, jclass clazz) {
         NATIVE_METHOD(XposedBridge, invalidateCallersNative, "([Ljava/lang/reflect/Member;)V"),
 #endif
     };
-    return env->RegisterNatives(clazz, methods, NELEM(methods));
+    int result = env->RegisterNatives(clazz, methods, NELEM(methods));
+    if (result == JNI_OK)
+        register_optional_natives_XposedBridge(env, clazz);
+    return result;
 }
 
 int register_natives_XResources(JNIEnv* env, jclass clazz) {
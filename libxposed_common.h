@@ -24,7 +24,6 @@ namespace xposed {
 extern jclass classXposedBridge;
 extern jmethodID methodXposedBridgeHandleHookedMethod;
 
-extern int readIntConfig(const char* fileName, int defaultValue);
 extern void onVmCreatedCommon(JNIEnv* env);
 
 
@@ -39,19 +38,25 @@ extern void logExceptionStackTrace();
 extern jint    XposedBridge_getRuntime(JNIEnv* env, jclass clazz);
 extern void    XposedBridge_hookMethodNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect,
                                              jobject declaredClassIndirect, jint slot, jobject additionalInfoIndirect);
+extern void    XposedBridge_hookMethodsNative(JNIEnv* env, jclass clazz, jobjectArray reflectedMethodsIndirect,
+                                              jobjectArray additionalInfosIndirect);
 extern void    XposedBridge_setObjectClassNative(JNIEnv* env, jclass clazz, jobject objIndirect, jclass clzIndirect);
 extern jobject XposedBridge_cloneToSubclassNative(JNIEnv* env, jclass clazz, jobject objIndirect, jclass clzIndirect);
 extern void    XposedBridge_dumpObjectNative(JNIEnv* env, jclass clazz, jobject objIndirect);
 extern void    XposedBridge_removeFinalFlagNative(JNIEnv* env, jclass clazz, jclass javaClazz);
+extern jlong   XposedBridge_resolveOriginalMethodNative(JNIEnv* env, jclass clazz, jobject reflectedMethodIndirect);
 
 #if PLATFORM_SDK_VERSION >= 21
 extern jobject XposedBridge_invokeOriginalMethodNative(JNIEnv* env, jclass, jobject javaMethod, jint, jobjectArray,
                                                        jclass, jobject javaReceiver, jobjectArray javaArgs);
+extern jlong   XposedBridge_invokeOriginalMethodRawNative(JNIEnv* env, jclass, jlong handle, jobject javaReceiver,
+                                                          jlongArray javaArgs);
 extern void    XposedBridge_closeFilesBeforeForkNative(JNIEnv* env, jclass clazz);
 extern void    XposedBridge_reopenFilesAfterForkNative(JNIEnv* env, jclass clazz);
 #endif
 #if PLATFORM_SDK_VERSION >= 24
 extern void    XposedBridge_invalidateCallersNative(JNIEnv*, jclass, jobjectArray javaMethods);
+extern void    XposedBridge_flushInvalidationsNative(JNIEnv*, jclass);
 #endif
 
 }  // namespace xposed
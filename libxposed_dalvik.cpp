@@ -18,6 +18,9 @@ namespace xposed {
 bool initMemberOffsets(JNIEnv* env);
 void hookedMethodCallback(const u4* args, JValue* pResult, const Method* method, ::Thread* self);
 void XposedBridge_invokeOriginalMethodNative(const u4* args, JValue* pResult, const Method* method, ::Thread* self);
+void XposedBridge_invokeOriginalMethodRawNative(const u4* args, JValue* pResult, const Method* method, ::Thread* self);
+static bool hookMethod(JNIEnv* env, Method* method, jobject reflectedMethodIndirect, jobject additionalInfoIndirect);
+static void resetJitCache();
 
 
 ////////////////////////////////////////////////////////////
@@ -65,6 +68,16 @@ bool onVmCreated(JNIEnv* env) {
     }
     dvmSetNativeFunc(xposedInvokeOriginalMethodNative, XposedBridge_invokeOriginalMethodNative, NULL);
 
+    Method* xposedInvokeOriginalMethodRawNative = (Method*) env->GetStaticMethodID(classXposedBridge, "invokeOriginalMethodRawNative",
+        "(JLjava/lang/Object;[J)J");
+    if (xposedInvokeOriginalMethodRawNative != NULL) {
+        dvmSetNativeFunc(xposedInvokeOriginalMethodRawNative, XposedBridge_invokeOriginalMethodRawNative, NULL);
+    } else {
+        // Older versions of XposedBridge don't have the raw invocation yet
+        ALOGD("%s.invokeOriginalMethodRawNative() is not declared, not registering it", CLASS_XPOSED_BRIDGE);
+        env->ExceptionClear();
+    }
+
     objectArrayClass = dvmFindArrayClass("[Ljava/lang/Object;", NULL);
     if (objectArrayClass == NULL) {
         ALOGE("Error while loading Object[] class");
@@ -88,7 +101,7 @@ bool initMemberOffsets(JNIEnv* env) {
 
     MEMBER_OFFSET_COPY(DvmJitGlobals, codeCacheFull);
 
-    int overrideCodeCacheFull = readIntConfig(XPOSED_OVERRIDE_JIT_RESET_OFFSET, -1);
+    int overrideCodeCacheFull = xposed->config.jitResetOffset;
     if (overrideCodeCacheFull > 0 && overrideCodeCacheFull < 0x400) {
         ALOGI("Offset for DvmJitGlobals.codeCacheFull is overridden, new value is 0x%x", overrideCodeCacheFull);
         MEMBER_OFFSET_VAR(DvmJitGlobals, codeCacheFull) = overrideCodeCacheFull;
@@ -251,9 +264,59 @@ void XposedBridge_hookMethodNative(JNIEnv* env, jclass clazz, jobject reflectedM
         return;
     }
 
+    if (hookMethod(env, method, reflectedMethodIndirect, additionalInfoIndirect)) {
+        resetJitCache();
+    }
+}
+
+void XposedBridge_hookMethodsNative(JNIEnv* env, jclass, jobjectArray reflectedMethodsIndirect,
+            jobjectArray additionalInfosIndirect) {
+    if (reflectedMethodsIndirect == NULL || additionalInfosIndirect == NULL) {
+        dvmThrowIllegalArgumentException("methods and additionalInfos must not be null");
+        return;
+    }
+
+    jsize count = env->GetArrayLength(reflectedMethodsIndirect);
+    if (env->GetArrayLength(additionalInfosIndirect) != count) {
+        dvmThrowIllegalArgumentException("methods and additionalInfos must have the same length");
+        return;
+    }
+
+    int64_t start = monotonicNs();
+
+    jsize hooked = 0;
+    for (jsize i = 0; i < count; i++) {
+        jobject reflectedMethod = env->GetObjectArrayElement(reflectedMethodsIndirect, i);
+        if (reflectedMethod == NULL) {
+            dvmThrowIllegalArgumentException("method must not be null");
+            break;
+        }
+        Method* method = dvmGetMethodFromReflectObj((Object*) dvmDecodeIndirectRef(dvmThreadSelf(), reflectedMethod));
+        if (method == NULL) {
+            env->DeleteLocalRef(reflectedMethod);
+            dvmThrowNoSuchMethodError("Could not get internal representation for method");
+            break;
+        }
+        jobject additionalInfo = env->GetObjectArrayElement(additionalInfosIndirect, i);
+        if (hookMethod(env, method, reflectedMethod, additionalInfo))
+            hooked++;
+        env->DeleteLocalRef(additionalInfo);
+        env->DeleteLocalRef(reflectedMethod);
+    }
+
+    // The JIT cache only needs to be reset once for the whole batch, also if it stopped at an invalid entry
+    if (hooked > 0)
+        resetJitCache();
+
+    long us = (monotonicNs() - start) / 1000;
+    ALOGI("Hooked %d of %d methods in %ld us", hooked, count, us);
+}
+
+/** Replaces the method with our own code, returns false if it was already hooked. */
+static bool hookMethod(JNIEnv* env, Method* method, jobject reflectedMethodIndirect, jobject additionalInfoIndirect) {
     if (isMethodHooked(method)) {
         // already hooked
-        return;
+        return false;
     }
 
     // Save a copy of the original method and other hook info
@@ -268,7 +331,10 @@ void XposedBridge_hookMethodNative(JNIEnv* env, jclass clazz, jobject reflectedM
     method->insns = (const u2*) hookInfo;
     method->registersSize = method->insSize;
     method->outsSize = 0;
+    return true;
+}
 
+static void resetJitCache() {
     if (PTR_gDvmJit != NULL) {
         // reset JIT cache
         char currentValue = *((char*)PTR_gDvmJit + MEMBER_OFFSET_VAR(DvmJitGlobals,codeCacheFull));
@@ -304,6 +370,107 @@ void XposedBridge_invokeOriginalMethodNative(const u4* args, JValue* pResult,
     return;
 }
 
+/**
+ * Returns a handle for invokeOriginalMethodRawNative(), which refers to the original code of hooked methods.
+ * Hooks modify the method in place, so a handle resolved before the method is hooked invokes the hook.
+ */
+jlong XposedBridge_resolveOriginalMethodNative(JNIEnv*, jclass, jobject reflectedMethodIndirect) {
+    if (reflectedMethodIndirect == NULL) {
+        dvmThrowIllegalArgumentException("method must not be null");
+        return 0;
+    }
+
+    Method* meth = dvmGetMethodFromReflectObj((Object*) dvmDecodeIndirectRef(dvmThreadSelf(), reflectedMethodIndirect));
+    if (meth == NULL) {
+        dvmThrowNoSuchMethodError("Could not get internal representation for method");
+        return 0;
+    }
+    if (isMethodHooked(meth)) {
+        meth = (Method*) meth->insns;
+    }
+    return (jlong) (uintptr_t) meth;
+}
+
+/**
+ * Calls a method resolved with resolveOriginalMethodNative() without boxing and type checks.
+ * Arguments and the result are passed as raw values (float and double as their bits),
+ * only methods without references in their parameters and return type are supported.
+ */
+void XposedBridge_invokeOriginalMethodRawNative(const u4* args, JValue* pResult,
+            const Method*, ::Thread* self) {
+    Method* meth = (Method*) (uintptr_t) dvmGetArgLong(args, 0);
+    Object* thisObject = (Object*) args[2];
+    ArrayObject* argList = (ArrayObject*) args[3];
+    pResult->j = 0;
+    if (meth == NULL) {
+        dvmThrowIllegalArgumentException("invalid method handle");
+        return;
+    }
+
+    const char* shorty = meth->shorty;
+    if (shorty[0] == 'L' || shorty[0] == '[') {
+        dvmThrowIllegalArgumentException("reference return types are not supported");
+        return;
+    }
+
+    size_t argCount = strlen(shorty) - 1;
+    if (argCount != (argList != NULL ? argList->length : 0)) {
+        dvmThrowIllegalArgumentException("wrong number of arguments");
+        return;
+    }
+
+    if (dvmIsStaticMethod(meth)) {
+        thisObject = NULL;
+        if (!dvmIsClassInitialized(meth->clazz) && !dvmInitClass(meth->clazz)) {
+            return;
+        }
+    } else if (thisObject == NULL) {
+        dvmThrowNullPointerException("null receiver");
+        return;
+    } else if (!dvmInstanceof(thisObject->clazz, meth->clazz)) {
+        dvmThrowIllegalArgumentException("receiver is not an instance of the declaring class");
+        return;
+    }
+
+    // Methods can't have more than 255 arguments
+    jvalue values[256];
+    const s8* rawValues = (argList != NULL) ? (const s8*) ((uintptr_t) argList + arrayContentsOffset) : NULL;
+    for (size_t i = 0; i < argCount; i++) {
+        switch (shorty[i + 1]) {
+            case 'Z': values[i].z = (rawValues[i] != 0); break;
+            case 'B': values[i].b = (jbyte) rawValues[i]; break;
+            case 'C': values[i].c = (jchar) rawValues[i]; break;
+            case 'S': values[i].s = (jshort) rawValues[i]; break;
+            case 'I':
+            case 'F': values[i].i = (jint) rawValues[i]; break;
+            case 'J':
+            case 'D': values[i].j = rawValues[i]; break;
+            default:
+                dvmThrowIllegalArgumentException("reference parameters are not supported");
+                return;
+        }
+    }
+
+    JValue result;
+    result.j = 0;
+    dvmCallMethodA(self, meth, thisObject, false, &result, values);
+    if (dvmCheckException(self)) {
+        return;
+    }
+
+    switch (shorty[0]) {
+        case 'Z': pResult->j = result.z; break;
+        case 'B': pResult->j = result.b; break;
+        case 'C': pResult->j = result.c; break;
+        case 'S': pResult->j = result.s; break;
+        case 'I': pResult->j = result.i; break;
+        case 'F': pResult->j = (u4) result.i; break;
+        case 'J':
+        case 'D': pResult->j = result.j; break;
+        default: break;
+    }
+}
+
 void XposedBridge_setObjectClassNative(JNIEnv* env, jclass clazz, jobject objIndirect, jclass clzIndirect) {
     Object* obj = (Object*) dvmDecodeIndirectRef(dvmThreadSelf(), objIndirect);
     ClassObject* clz = (ClassObject*) dvmDecodeIndirectRef(dvmThreadSelf(), clzIndirect);
@@ -8,8 +8,6 @@
 
 namespace xposed {
 
-#define XPOSED_OVERRIDE_JIT_RESET_OFFSET XPOSED_DIR "conf/jit_reset_offset"
-
 struct XposedHookInfo {
     struct {
         Method originalMethod;
@@ -3,37 +3,56 @@
  */
 
 #define LOG_TAG "Xposed"
+#define ATRACE_TAG ATRACE_TAG_DALVIK
 
 #include "xposed.h"
 #include "xposed_logcat.h"
 #include "xposed_safemode.h"
 #include "xposed_service.h"
+#include "xposed_stats.h"
 
 #include <cstring>
 #include <ctype.h>
+#include <dirent.h>
 #include <cutils/process_name.h>
 #include <cutils/properties.h>
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <link.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/wait.h>
+#include <time.h>
 
 #if PLATFORM_SDK_VERSION >= 18
+#include <cutils/trace.h>
 #include <sys/capability.h>
 #else
 #include <linux/capability.h>
 #endif
 
+#ifndef ElfW
+#if defined(__LP64__)
+#define ElfW(type) Elf64_ ## type
+#else
+#define ElfW(type) Elf32_ ## type
+#endif
+#endif
+
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID 3
+#endif
+
 namespace xposed {
 
 ////////////////////////////////////////////////////////////
 // Variables
 ////////////////////////////////////////////////////////////
 
-XposedShared* xposed = new XposedShared;
+XposedShared* xposed = new XposedShared();
 static int sdkVersion = -1;
 static char* argBlockStart;
 static size_t argBlockLength;
@@ -41,12 +60,108 @@ static size_t argBlockLength;
 const char* xposedVersion = "unknown (invalid " XPOSED_PROP_FILE ")";
 uint32_t xposedVersionInt = 0;
 
+struct ToolSkipRule {
+    char* className;
+    int argc;
+    char* argv[TOOLS_SKIP_MAX_ARGS];
+};
+static ToolSkipRule toolSkipRules[TOOLS_SKIP_MAX_RULES];
+static int toolSkipRuleCount = 0;
+
+struct BootPhase {
+    const char* name;
+    int64_t start;
+    int64_t duration;
+};
+static BootPhase timeline[XPOSED_TIMELINE_PHASES];
+static int timelinePhases = 0;
+
+static void runHelper(int argc, char* const argv[]);
+
+////////////////////////////////////////////////////////////
+// Startup timeline
+////////////////////////////////////////////////////////////
+
+ScopedPhase::ScopedPhase(const char* name) : index(-1) {
+#if PLATFORM_SDK_VERSION >= 18
+    ATRACE_BEGIN(name);
+#endif
+    if (timelinePhases < XPOSED_TIMELINE_PHASES) {
+        index = timelinePhases++;
+        timeline[index].name = name;
+        timeline[index].start = monotonicNs();
+        timeline[index].duration = -1;
+    }
+}
+
+ScopedPhase::~ScopedPhase() {
+    if (index >= 0)
+        timeline[index].duration = monotonicNs() - timeline[index].start;
+#if PLATFORM_SDK_VERSION >= 18
+    ATRACE_END();
+#endif
+}
+
+/** Log a summary of the startup phases and save them in a machine-readable file. */
+static void writeTimeline() {
+    // Tools are started too often to log their timeline every time
+    if (timelinePhases == 0 || !xposed->zygote)
+        return;
+
+    char summary[512];
+    size_t pos = 0;
+    for (int i = 0; i < timelinePhases && pos < sizeof(summary); i++) {
+        if (timeline[i].duration < 0)
+            continue;
+        pos += snprintf(summary + pos, sizeof(summary) - pos, "%s%s %" PRId64 ".%" PRId64 " ms",
+            (pos == 0) ? "" : ", ", timeline[i].name,
+            timeline[i].duration / 1000000, (timeline[i].duration / 100000) % 10);
+    }
+    ALOGI("Startup timeline: %s", summary);
+
+    // Phases are nested, the start offsets allow reconstructing the hierarchy
+    char tmpFile[sizeof(XPOSED_TIMELINE_FILE) + 4];
+    snprintf(tmpFile, sizeof(tmpFile), "%s.tmp", XPOSED_TIMELINE_FILE);
+    FILE* fp = fopen(tmpFile, "w");
+    if (fp == NULL) {
+        ALOGW("Could not write %s: %s", tmpFile, strerror(errno));
+        return;
+    }
+    fprintf(fp, "# phase\tstart_us\tduration_us\n");
+    for (int i = 0; i < timelinePhases; i++) {
+        fprintf(fp, "%s\t%" PRId64 "\t%" PRId64 "\n", timeline[i].name,
+            (timeline[i].start - timeline[0].start) / 1000,
+            (timeline[i].duration >= 0) ? timeline[i].duration / 1000 : -1);
+    }
+    fchmod(fileno(fp), 0644);
+    fclose(fp);
+
+    if (rename(tmpFile, XPOSED_TIMELINE_FILE) != 0) {
+        ALOGW("Could not rename %s: %s", tmpFile, strerror(errno));
+        unlink(tmpFile);
+    }
+}
+
 ////////////////////////////////////////////////////////////
 // Functions
 ////////////////////////////////////////////////////////////
 
 /** Handle special command line options. */
 bool handleOptions(int argc, char* const argv[]) {
+    ScopedPhase phase("handleOptions");
+
+    // From Lollipop coding, used to override the process name
+    argBlockStart = argv[0];
+    uintptr_t start = reinterpret_cast<uintptr_t>(argv[0]);
+    uintptr_t end = reinterpret_cast<uintptr_t>(argv[argc - 1]);
+    end += strlen(argv[argc - 1]) + 1;
+    argBlockLength = end - start;
+
+    if (argc >= 2 && strcmp(argv[1], XPOSED_HELPER_OPTION) == 0) {
+        runHelper(argc - 2, argv + 2);
+        return true;
+    }
+
     parseXposedProp();
 
     if (argc == 2 && strcmp(argv[1], "--xposedversion") == 0) {
@@ -54,34 +169,171 @@ bool handleOptions(int argc, char* const argv[]) {
         return true;
     }
 
-    if (argc == 2 && strcmp(argv[1], "--xposedtestsafemode") == 0) {
+    if (argc == 2 && strcmp(argv[1], "--xposedstats") == 0) {
+        printf("Xposed service statistics\n");
+        stats::dump();
+        return true;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--xposedtestsafemode") == 0) {
         printf("Testing Xposed safemode trigger\n");
 
-        if (detectSafemodeTrigger(shouldSkipSafemodeDelay())) {
-            printf("Safemode triggered\n");
-        } else {
-            printf("Safemode not triggered\n");
+        readConfig(&xposed->config);
+        bool skipInitialDelay = shouldSkipSafemodeDelay();
+        const char* devicePath = NULL;
+        const char* vibratorPath = NULL;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--nodelay") == 0) {
+                skipInitialDelay = true;
+            } else if (strcmp(argv[i], "--devices") == 0 && i + 1 < argc) {
+                devicePath = argv[++i];
+            } else if (strcmp(argv[i], "--vibrator") == 0 && i + 1 < argc) {
+                vibratorPath = argv[++i];
+            } else {
+                printf("Usage: --xposedtestsafemode [--nodelay] [--devices <dir>] [--vibrator <file>]\n");
+                return true;
+            }
         }
+        if (devicePath != NULL || vibratorPath != NULL)
+            setSafemodeTestPaths(devicePath, vibratorPath);
+
+        // This is the time that Zygote would have been blocked without background detection
+        int64_t start = monotonicNs();
+        bool triggered = detectSafemodeTrigger(skipInitialDelay);
+        int64_t elapsedMs = (monotonicNs() - start) / 1000000;
+        printf("Safemode %s, decided after %" PRId64 " ms\n", triggered ? "triggered" : "not triggered", elapsedMs);
         return true;
     }
 
-    // From Lollipop coding, used to override the process name
-    argBlockStart = argv[0];
-    uintptr_t start = reinterpret_cast<uintptr_t>(argv[0]);
-    uintptr_t end = reinterpret_cast<uintptr_t>(argv[argc - 1]);
-    end += strlen(argv[argc - 1]) + 1;
-    argBlockLength = end - start;
+    if (argc >= 2 && strcmp(argv[1], "--xposedbenchlog") == 0) {
+        printf("Benchmarking the Xposed log daemon\n");
+        logcat::runBenchmark(argc - 2, argv + 2);
+        return true;
+    }
 
     return false;
 }
 
-/** Initialize Xposed (unless it is disabled). */
-bool initialize(bool zygote, bool startSystemServer, const char* className, int argc, char* const argv[]) {
+/** Get the resident set size of this process in kB. */
+static long getRssKb() {
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL)
+        return -1;
+
+    long size, resident;
+    int count = fscanf(fp, "%ld %ld", &size, &resident);
+    fclose(fp);
+    return (count == 2) ? resident * (sysconf(_SC_PAGESIZE) / 1024) : -1;
+}
+
+/**
+ * Start a helper process by executing app_process again. Unlike a fork, the helper doesn't
+ * inherit Zygote's address space, which saves memory and the copy of the page tables.
+ * The file descriptors (the given one and the statistics region) and the additional argument
+ * (if any) are passed on to the helper. Returns -1 if the helper couldn't be executed.
+ */
+pid_t spawnHelper(const char* name, int fd, const char* arg) {
+    char uidArg[16], gidArg[16], fdArg[16], statsFdArg[16];
+    int statsFd = stats::getFd();
+    snprintf(uidArg, sizeof(uidArg), "%u", (unsigned) xposed->installer_uid);
+    snprintf(gidArg, sizeof(gidArg), "%u", (unsigned) xposed->installer_gid);
+    snprintf(fdArg, sizeof(fdArg), "%d", fd);
+    snprintf(statsFdArg, sizeof(statsFdArg), "%d", statsFd);
+    char* const args[] = {
+        (char*) "xposed_helper", (char*) XPOSED_HELPER_OPTION, (char*) name, uidArg, gidArg,
+        fdArg, statsFdArg, (char*) arg, NULL
+    };
+
+    // Closed automatically by a successful exec, otherwise the child reports the error through it
+    int statusPipe[2];
+    if (pipe2(statusPipe, O_CLOEXEC) != 0) {
+        ALOGE("Could not create status pipe for helper %s: %s", name, strerror(errno));
+        stats::add(stats::STATS_HELPER_FAILURES);
+        return -1;
+    }
+
+    int64_t start = monotonicNs();
+    pid_t pid = vfork();
+    if (pid < 0) {
+        ALOGE("Could not start helper %s: %s", name, strerror(errno));
+        stats::add(stats::STATS_HELPER_FAILURES);
+        close(statusPipe[0]);
+        close(statusPipe[1]);
+        return -1;
+    } else if (pid == 0) {
+        // Only affects the file descriptor table of the child
+        if (fd >= 0)
+            fcntl(fd, F_SETFD, 0);
+        if (statsFd >= 0)
+            fcntl(statsFd, F_SETFD, 0);
+        execv(XPOSED_HELPER_EXE, args);
+        int err = errno;
+        TEMP_FAILURE_RETRY(write(statusPipe[1], &err, sizeof(err)));
+        _exit(EXIT_FAILURE);
+    }
+
+    close(statusPipe[1]);
+    int err = 0;
+    ssize_t len = TEMP_FAILURE_RETRY(read(statusPipe[0], &err, sizeof(err)));
+    close(statusPipe[0]);
+    if (len > 0) {
+        ALOGE("Could not execute helper %s: %s", name, strerror(err));
+        stats::add(stats::STATS_HELPER_FAILURES);
+        TEMP_FAILURE_RETRY(waitpid(pid, NULL, 0));
+        return -1;
+    }
+
+    ALOGD("Started helper %s (PID %d) in %" PRId64 " us", name, pid, (monotonicNs() - start) / 1000);
+    return pid;
+}
+
+/** Entry point for the helper processes started by spawnHelper(). */
+static void runHelper(int argc, char* const argv[]) {
+    // <name> <installer uid> <installer gid> <fd> <stats fd> [<arg>]
+    if (argc < 5) {
+        ALOGE("Invalid arguments for %s", XPOSED_HELPER_OPTION);
+        exit(EXIT_FAILURE);
+    }
+
+    const char* name = argv[0];
+    xposed->installer_uid = strtoul(argv[1], NULL, 10);
+    xposed->installer_gid = strtoul(argv[2], NULL, 10);
+    int fd = atoi(argv[3]);
+    int statsFd = atoi(argv[4]);
+    const char* arg = (argc >= 6) ? argv[5] : NULL;
+
+#if XPOSED_WITH_SELINUX
+    xposed->isSELinuxEnabled   = is_selinux_enabled() == 1;
+    xposed->isSELinuxEnforcing = xposed->isSELinuxEnabled && security_getenforce() == 1;
+#endif  // XPOSED_WITH_SELINUX
+
+    ALOGD("Helper %s is running with %ld kB RSS", name, getRssKb());
+    if (statsFd >= 0)
+        stats::attach(statsFd);
+
+    service::runHelper(name, fd, arg);
+
+    // Should never reach this point
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Initialize Xposed (unless it is disabled).
+ * For tools, argv[firstToolArg] is the first argument after the class name.
+ */
+bool initialize(bool zygote, bool startSystemServer, const char* className, int argc, char* const argv[],
+        int firstToolArg) {
+    ScopedPhase phase("initialize");
+
 #if !defined(XPOSED_ENABLE_FOR_TOOLS)
     if (!zygote)
         return false;
 #endif
 
+    // Tools are often started in loops by scripts, so skip them as early as possible
+    if (!zygote && shouldSkipTool(className, argc - firstToolArg, argv + firstToolArg))
+        return false;
+
     if (isMinimalFramework()) {
         ALOGI("Not loading Xposed for minimal framework (encrypted device)");
         return false;
@@ -101,21 +353,36 @@ bool initialize(bool zygote, bool startSystemServer, const char* className, int
 #endif  // XPOSED_WITH_SELINUX
 
     if (startSystemServer) {
+        // Must come first: replaces the state of a previous primary Zygote in this boot, so the
+        // secondary one can't pick up its flags before the current instance has set them again
+        setPrimaryZygoteReady(false);
         xposed::logcat::printStartupMarker();
     } else if (zygote) {
-        // TODO Find a better solution for this
-        // Give the primary Zygote process a little time to start first.
+        // Let the primary Zygote process start the services and the daemon first.
         // This also makes the log easier to read, as logs for the two Zygotes are not mixed up.
-        sleep(10);
+        waitForPrimaryZygote();
     }
 
     printRomInfo();
 
     if (startSystemServer) {
-        if (!determineXposedInstallerUidGid() || !xposed::service::startAll()) {
+        // The UID of Xposed Installer is needed by the services and the daemon, which also captures the log.
+        bool servicesStarted;
+        {
+            ScopedPhase servicesPhase("startServices");
+            // Statistics are optional, the helpers just don't record anything without them
+            xposed::stats::init();
+            servicesStarted = determineXposedInstallerUidGid()
+                && xposed::service::startAll(xposed::logcat::getStartupMarker())
+                && xposed::service::waitForStartup();
+            xposed::stats::release();
+        }
+        setPrimaryZygoteReady(true);
+        if (!servicesStarted) {
+            // Don't let the secondary Zygote wait for a safemode detection that won't happen
+            setSafemodeResult(false);
             return false;
         }
-        xposed::logcat::start();
 #if XPOSED_WITH_SELINUX
     } else if (xposed->isSELinuxEnabled) {
         if (!xposed::service::startMembased()) {
@@ -124,6 +391,10 @@ bool initialize(bool zygote, bool startSystemServer, const char* className, int
 #endif  // XPOSED_WITH_SELINUX
     }
 
+    loadConfig();
+    if (zygote)
+        loadProcessFilter();
+
 #if XPOSED_WITH_SELINUX
     // Don't let any further forks access the Zygote service
     if (xposed->isSELinuxEnabled) {
@@ -132,17 +403,148 @@ bool initialize(bool zygote, bool startSystemServer, const char* className, int
 #endif  // XPOSED_WITH_SELINUX
 
     // FIXME Zygote has no access to input devices, this would need to be check in system_server context
-    if (zygote && !isSafemodeDisabled() && detectSafemodeTrigger(shouldSkipSafemodeDelay()))
-        disableXposed();
+    // The detection runs in the background, the result is checked before the modules are loaded.
+    // It is only done once by the primary Zygote, the secondary one uses the same result.
+    if (startSystemServer && !isSafemodeDisabled()) {
+        ScopedPhase safemodePhase("detectSafemode");
+        if (!startSafemodeDetection(shouldSkipSafemodeDelay())) {
+            bool triggered = detectSafemodeTrigger(shouldSkipSafemodeDelay());
+            setSafemodeResult(triggered);
+            if (triggered)
+                disableXposed();
+        }
+    }
+
+    if (isDisabled() || (!zygote && shouldIgnoreCommand(argc, argv)) || !addJarToClasspath()) {
+        // The result will never be checked
+        releaseSafemodeDetection();
+        return false;
+    }
 
-    if (isDisabled() || (!zygote && shouldIgnoreCommand(argc, argv)))
+    return true;
+}
+
+/** Read the ID of the current boot, which is used to detect state files from previous boots. */
+static void getBootId(char* bootId, size_t size) {
+    memset(bootId, 0, size);
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    ssize_t len = TEMP_FAILURE_RETRY(read(fd, bootId, size - 1));
+    close(fd);
+    if (len > 0 && bootId[len - 1] == '\n')
+        bootId[len - 1] = 0;
+}
+
+/** PID of the primary Zygote, also known to the processes it forks. */
+static pid_t primaryZygotePid = 0;
+
+/**
+ * Read the state written by the primary Zygote. Returns false if there is none for the current boot,
+ * or if it was written by a primary Zygote that has died meanwhile (i.e. Zygote was restarted).
+ */
+static bool readZygoteState(ZygoteState* state) {
+    int fd = open(XPOSED_ZYGOTE_STATE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
         return false;
 
-    return addJarToClasspath();
+    ssize_t len = TEMP_FAILURE_RETRY(read(fd, state, sizeof(ZygoteState)));
+    close(fd);
+    if (len != sizeof(ZygoteState))
+        return false;
+
+    char bootId[sizeof(state->bootId)];
+    getBootId(bootId, sizeof(bootId));
+    if (memcmp(bootId, state->bootId, sizeof(bootId)) != 0)
+        return false;
+
+    return state->primaryPid > 0 && (kill(state->primaryPid, 0) == 0 || errno != ESRCH);
+}
+
+static void initZygoteState(ZygoteState* state) {
+    memset(state, 0, sizeof(*state));
+    getBootId(state->bootId, sizeof(state->bootId));
+    state->primaryPid = primaryZygotePid;
+}
+
+/** Replace the state file atomically, so the other Zygote never sees a partially written one. */
+static void writeZygoteState(const ZygoteState* state) {
+    int fd = open(XPOSED_ZYGOTE_STATE ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        ALOGE("Could not open %s: %s", XPOSED_ZYGOTE_STATE ".tmp", strerror(errno));
+        return;
+    }
+
+    bool success = TEMP_FAILURE_RETRY(write(fd, state, sizeof(ZygoteState))) == sizeof(ZygoteState);
+    close(fd);
+    if (!success || rename(XPOSED_ZYGOTE_STATE ".tmp", XPOSED_ZYGOTE_STATE) != 0) {
+        ALOGE("Could not write %s: %s", XPOSED_ZYGOTE_STATE, strerror(errno));
+        unlink(XPOSED_ZYGOTE_STATE ".tmp");
+    }
+}
+
+/** Tell the secondary Zygote whether the primary one has finished starting the services. */
+void setPrimaryZygoteReady(bool ready) {
+    if (primaryZygotePid == 0)
+        primaryZygotePid = getpid();
+
+    ZygoteState state;
+    initZygoteState(&state);
+    state.flags = ready ? ZYGOTE_STATE_READY : 0;
+    writeZygoteState(&state);
+}
+
+/** Wait until the primary Zygote has set a flag in the state file. Returns the elapsed time, or -1 on timeout. */
+static long waitForZygoteState(uint32_t flag, int timeout, ZygoteState* state) {
+    int64_t start = monotonicNs();
+    long elapsedMs = 0;
+    while (!readZygoteState(state) || !(state->flags & flag)) {
+        if (elapsedMs >= timeout * 1000)
+            return -1;
+        usleep(ZYGOTE_WAIT_INTERVAL * 1000);
+        elapsedMs = (monotonicNs() - start) / 1000000;
+    }
+    return elapsedMs;
+}
+
+/** Wait until the primary Zygote is ready, but not longer than ZYGOTE_WAIT_TIMEOUT seconds. */
+void waitForPrimaryZygote() {
+    ZygoteState state;
+    long elapsedMs = waitForZygoteState(ZYGOTE_STATE_READY, ZYGOTE_WAIT_TIMEOUT, &state);
+    if (elapsedMs < 0) {
+        ALOGW("Primary Zygote was not ready after %d seconds, continuing anyway", ZYGOTE_WAIT_TIMEOUT);
+        return;
+    }
+    ALOGD("Waited %ld ms for the primary Zygote", elapsedMs);
+}
+
+/** Share the result of the safemode detection with the secondary Zygote. */
+void setSafemodeResult(bool triggered) {
+    ZygoteState state;
+    if (!readZygoteState(&state) || state.primaryPid != primaryZygotePid)
+        initZygoteState(&state);
+    state.flags |= ZYGOTE_STATE_SAFEMODE_DONE;
+    if (triggered)
+        state.flags |= ZYGOTE_STATE_SAFEMODE_TRIGGERED;
+    writeZygoteState(&state);
+}
+
+/** Use the result of the safemode detection in the primary Zygote instead of detecting it again. */
+static bool waitForPrimarySafemodeResult() {
+    ZygoteState state;
+    long elapsedMs = waitForZygoteState(ZYGOTE_STATE_SAFEMODE_DONE, SAFEMODE_WAIT_TIMEOUT, &state);
+    if (elapsedMs < 0) {
+        ALOGW("No safemode result from the primary Zygote after %d seconds, continuing anyway", SAFEMODE_WAIT_TIMEOUT);
+        return false;
+    }
+    ALOGD("Waited %ld ms for the safemode result of the primary Zygote", elapsedMs);
+    return (state.flags & ZYGOTE_STATE_SAFEMODE_TRIGGERED) != 0;
 }
 
 /** Print information about the used ROM into the log */
 void printRomInfo() {
+    ScopedPhase phase("printRomInfo");
     char release[PROPERTY_VALUE_MAX];
     char sdk[PROPERTY_VALUE_MAX];
     char manufacturer[PROPERTY_VALUE_MAX];
@@ -178,8 +580,47 @@ void printRomInfo() {
             xposed->isSELinuxEnforcing ? "yes" : "no");
 }
 
+/** Add a rule for a tool invocation that should be started without Xposed. */
+static void addToolSkipRule(const char* value) {
+    if (toolSkipRuleCount >= TOOLS_SKIP_MAX_RULES) {
+        ALOGW("Ignoring tools.skip=%s, only %d rules are supported", value, TOOLS_SKIP_MAX_RULES);
+        return;
+    }
+
+    ToolSkipRule* rule = &toolSkipRules[toolSkipRuleCount];
+    memset(rule, 0, sizeof(ToolSkipRule));
+
+    // The rule keeps pointers into this copy
+    char* copy = strdup(value);
+    if (copy == NULL)
+        return;
+
+    char* saveptr;
+    char* token = strtok_r(copy, " \t", &saveptr);
+    if (token == NULL) {
+        free(copy);
+        return;
+    }
+
+    rule->className = token;
+    while ((token = strtok_r(NULL, " \t", &saveptr)) != NULL) {
+        if (rule->argc >= TOOLS_SKIP_MAX_ARGS) {
+            ALOGW("Ignoring tools.skip=%s, only %d arguments are supported", value, TOOLS_SKIP_MAX_ARGS);
+            free(copy);
+            return;
+        }
+        rule->argv[rule->argc++] = token;
+    }
+    toolSkipRuleCount++;
+}
+
+static int compareToolSkipRules(const void* a, const void* b) {
+    return strcmp(((const ToolSkipRule*) a)->className, ((const ToolSkipRule*) b)->className);
+}
+
 /** Parses /system/xposed.prop and stores selected values in variables */
 void parseXposedProp() {
+    ScopedPhase phase("parseXposedProp");
     FILE *fp = fopen(XPOSED_PROP_FILE, "r");
     if (fp == NULL) {
         ALOGE("Could not read %s: %s", XPOSED_PROP_FILE, strerror(errno));
@@ -222,10 +663,15 @@ void parseXposedProp() {
             strlcpy(tmp, value, len + 1);
             xposedVersion = tmp;
             xposedVersionInt = atoi(xposedVersion);
+        } else if (!strcmp("tools.skip", key)) {
+            addToolSkipRule(value);
         }
     }
     fclose(fp);
 
+    // Sort the rules by class name, so they can be looked up quickly for each tool invocation
+    qsort(toolSkipRules, toolSkipRuleCount, sizeof(ToolSkipRule), compareToolSkipRules);
+
     return;
 }
 
@@ -239,9 +685,170 @@ int getSdkVersion() {
     return sdkVersion;
 }
 
+/** Check whether a directory entry is the configuration file with the given path. */
+static inline bool isConfigFile(const char* name, const char* path) {
+    return strcmp(name, path + sizeof(XPOSED_CONF_DIR) - 1) == 0;
+}
+
+/** Read the (short) content of a configuration file. */
+static bool readConfigValue(int dirFd, const char* name, char* buf, size_t size) {
+    int fd = TEMP_FAILURE_RETRY(openat(dirFd, name, O_RDONLY | O_CLOEXEC));
+    if (fd < 0)
+        return false;
+
+    ssize_t len = TEMP_FAILURE_RETRY(read(fd, buf, size - 1));
+    close(fd);
+    if (len < 0)
+        return false;
+
+    buf[len] = '\0';
+    return true;
+}
+
+/** Read all configuration files in a single pass over the conf/ directory. */
+void readConfig(XposedConfig* config) {
+    memset(config, 0, sizeof(XposedConfig));
+    config->jitResetOffset = -1;
+
+    DIR* dir = opendir(XPOSED_CONF_DIR);
+    if (dir == NULL) {
+        int err = errno;
+        if (err != ENOENT)
+            ALOGW("Could not open %s: %s", XPOSED_CONF_DIR, strerror(err));
+        config->loaded = (err == ENOENT);
+        return;
+    }
+
+    struct dirent* entry;
+    char value[64];
+    while ((entry = readdir(dir)) != NULL) {
+        const char* name = entry->d_name;
+        if (isConfigFile(name, XPOSED_LOAD_BLOCKER)) {
+            config->disabled = true;
+        } else if (isConfigFile(name, XPOSED_SAFEMODE_DISABLE)) {
+            config->safemodeDisabled = true;
+        } else if (isConfigFile(name, XPOSED_SAFEMODE_NODELAY)) {
+            config->safemodeNoDelay = true;
+        } else if (isConfigFile(name, XPOSEDLOG_CONF_ALL)) {
+            config->logAll = true;
+        } else if (isConfigFile(name, XPOSEDLOG_CONF_RATELIMIT)) {
+            // Format: <lines per second> [<burst>]
+            long rate = 0, burst = 0;
+            int count = readConfigValue(dirfd(dir), name, value, sizeof(value))
+                ? sscanf(value, "%ld %ld", &rate, &burst) : 0;
+            if (count >= 1 && rate > 0) {
+                config->logRateLimit = rate;
+                config->logRateBurst = (count >= 2 && burst > 0) ? burst : rate * 2;
+            }
+        } else if (isConfigFile(name, XPOSED_JIT_RESET_OFFSET)) {
+            int offset;
+            if (readConfigValue(dirfd(dir), name, value, sizeof(value)) && sscanf(value, "%i", &offset) >= 1)
+                config->jitResetOffset = offset;
+        }
+    }
+
+    closedir(dir);
+    config->loaded = true;
+}
+
+/** Load the configuration into memory, using the Zygote service if needed. */
+void loadConfig() {
+#if XPOSED_WITH_SELINUX
+    if (xposed->isSELinuxEnabled) {
+        if (xposed::service::membased::readConfig(&xposed->config) != 0)
+            ALOGE("Could not load the Xposed configuration: %s", strerror(errno));
+        return;
+    }
+#endif  // XPOSED_WITH_SELINUX
+
+    readConfig(&xposed->config);
+}
+
+/** Check that the counts and offsets in the process filter are within the file. */
+static bool validateProcessFilter(const char* content, int size) {
+    const ProcessFilterHeader* header = (const ProcessFilterHeader*) content;
+    if ((size_t) size < sizeof(ProcessFilterHeader)
+            || header->magic != PROCESS_FILTER_MAGIC || header->version != PROCESS_FILTER_VERSION)
+        return false;
+
+    uint64_t expectedSize = sizeof(ProcessFilterHeader)
+        + (uint64_t) header->appIdCount * sizeof(uint32_t)
+        + (uint64_t) header->nameCount * sizeof(uint32_t)
+        + header->namesSize;
+    if (expectedSize != (uint64_t) size)
+        return false;
+
+    const uint32_t* nameOffsets = (const uint32_t*) (header + 1) + header->appIdCount;
+    const char* names = (const char*) (nameOffsets + header->nameCount);
+    if (header->namesSize > 0 && names[header->namesSize - 1] != '\0')
+        return false;
+    for (uint32_t i = 0; i < header->nameCount; i++) {
+        if (nameOffsets[i] >= header->namesSize)
+            return false;
+    }
+    return true;
+}
+
+/** Load the process filter prepared by Xposed Installer into read-only memory, which all apps inherit. */
+void loadProcessFilter() {
+    char* content = NULL;
+    int size = 0;
+#if XPOSED_WITH_SELINUX
+    if (xposed->isSELinuxEnabled) {
+        struct stat st;
+        if (xposed::service::membased::statFile(XPOSED_PROCESS_FILTER, &st) != 0)
+            return;
+        if (st.st_size > PROCESS_FILTER_MAX_SIZE) {
+            ALOGE("%s is too large (%lld bytes)", XPOSED_PROCESS_FILTER, (long long) st.st_size);
+            return;
+        }
+        content = xposed::service::membased::readFile(XPOSED_PROCESS_FILTER, &size);
+    } else
+#endif  // XPOSED_WITH_SELINUX
+    {
+        int fd = TEMP_FAILURE_RETRY(open(XPOSED_PROCESS_FILTER, O_RDONLY | O_CLOEXEC));
+        if (fd < 0)
+            return;
+        // Without a filter, modules are simply loaded into all processes
+        content = (char*) malloc(PROCESS_FILTER_MAX_SIZE + 1);
+        if (content == NULL) {
+            ALOGE("Could not allocate memory to read %s", XPOSED_PROCESS_FILTER);
+            close(fd);
+            return;
+        }
+        ssize_t len = TEMP_FAILURE_RETRY(read(fd, content, PROCESS_FILTER_MAX_SIZE + 1));
+        close(fd);
+        size = (len > 0 && len <= PROCESS_FILTER_MAX_SIZE) ? len : 0;
+    }
+
+    if (content == NULL)
+        return;
+
+    if (!validateProcessFilter(content, size)) {
+        ALOGE("Ignoring invalid process filter %s", XPOSED_PROCESS_FILTER);
+        free(content);
+        return;
+    }
+
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        ALOGE("Could not allocate memory for the process filter: %s", strerror(errno));
+        free(content);
+        return;
+    }
+    memcpy(mem, content, size);
+    free(content);
+    mprotect(mem, size, PROT_READ);
+
+    xposed->processFilter = (const ProcessFilterHeader*) mem;
+    xposed->processFilterSize = size;
+    ALOGI("Loaded process filter with %u app IDs and %u process names", xposed->processFilter->appIdCount,
+        xposed->processFilter->nameCount);
+}
+
 /** Check whether Xposed is disabled by a flag file */
 bool isDisabled() {
-    if (zygote_access(XPOSED_LOAD_BLOCKER, F_OK) == 0) {
+    if (xposed->config.disabled) {
         ALOGE("Found %s, not loading Xposed", XPOSED_LOAD_BLOCKER);
         return true;
     }
@@ -255,22 +862,48 @@ void disableXposed() {
     fd = open(XPOSED_LOAD_BLOCKER, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
     if (fd >= 0)
         close(fd);
+    xposed->config.disabled = true;
 }
 
 /** Check whether safemode is disabled. */
 bool isSafemodeDisabled() {
-    if (zygote_access(XPOSED_SAFEMODE_DISABLE, F_OK) == 0)
-        return true;
-    else
-        return false;
+    return xposed->config.safemodeDisabled;
 }
 
 /** Check whether the delay for safemode should be skipped. */
 bool shouldSkipSafemodeDelay() {
-    if (zygote_access(XPOSED_SAFEMODE_NODELAY, F_OK) == 0)
-        return true;
-    else
+    return xposed->config.safemodeNoDelay;
+}
+
+/** Check whether the tool invocation (class name and its arguments) matches one of the tools.skip rules from xposed.prop. */
+bool shouldSkipTool(const char* className, int toolArgc, const char* const toolArgv[]) {
+    if (toolSkipRuleCount == 0 || className == NULL)
         return false;
+
+    // Binary search for the first rule for this class
+    int low = 0, high = toolSkipRuleCount;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (strcmp(toolSkipRules[mid].className, className) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    for (int i = low; i < toolSkipRuleCount && strcmp(toolSkipRules[i].className, className) == 0; i++) {
+        const ToolSkipRule* rule = &toolSkipRules[i];
+        if (rule->argc > toolArgc)
+            continue;
+
+        bool matches = true;
+        for (int j = 0; j < rule->argc && matches; j++) {
+            matches = strcmp(rule->argv[j], "*") == 0 || strcmp(rule->argv[j], toolArgv[j]) == 0;
+        }
+        if (matches)
+            return true;
+    }
+
+    return false;
 }
 
 /** Ignore the broadcasts by various Superuser implementations to avoid spamming the Xposed log. */
@@ -303,6 +936,19 @@ bool shouldIgnoreCommand(int argc, const char* const argv[]) {
     return false;
 }
 
+/** Ask the kernel to read a file into the page cache in the background. */
+static bool prefetchFile(const char* path) {
+    int fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY | O_CLOEXEC));
+    if (fd < 0)
+        return false;
+
+    int err = posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    if (err != 0)
+        ALOGW("Could not prefetch %s: %s", path, strerror(err));
+    close(fd);
+    return true;
+}
+
 /** Adds a path to the beginning of an environment variable. */
 static bool addPathToEnv(const char* name, const char* path) {
     char* oldPath = getenv(name);
@@ -336,7 +982,8 @@ bool addJarToClasspath() {
     }
     */
 
-    if (access(XPOSED_JAR, R_OK) == 0) {
+    // The jar is read soon when the VM starts, so let the I/O overlap with the VM creation
+    if (prefetchFile(XPOSED_JAR)) {
         if (!addPathToEnv("CLASSPATH", XPOSED_JAR))
             return false;
 
@@ -348,8 +995,105 @@ bool addJarToClasspath() {
     }
 }
 
+/** Prefetch the APKs of the enabled modules, which are loaded when XposedBridge is initialized. */
+void prefetchModules() {
+    FILE* fp = fopen(XPOSED_MODULES_LIST, "r");
+    if (fp == NULL)
+        return;
+
+    char path[PATH_MAX];
+    int count = 0;
+    while (fgets(path, sizeof(path), fp) != NULL) {
+        path[strcspn(path, "\r\n")] = '\0';
+        if (path[0] == '\0')
+            continue;
+
+        if (prefetchFile(path))
+            count++;
+    }
+    fclose(fp);
+
+    ALOGD("Prefetching %d module file(s)", count);
+}
+
+struct RuntimeLib {
+    const char* libName;
+    const char* runtimeName;
+    const char* xposedLibPath;
+};
+
+static const RuntimeLib runtimeLibs[] = {
+    { "libart.so", "ART",    XPOSED_LIB_ART },
+    { "libdvm.so", "Dalvik", XPOSED_LIB_DALVIK },
+};
+
+struct RuntimeLibInfo {
+    const RuntimeLib* lib;
+    uintptr_t base;
+    const ElfW(Phdr)* phdr;
+    int phnum;
+};
+
+/** Match a loaded library by its file name and remember the matching libxposed_*.so. */
+static bool matchRuntimeLib(const char* path, RuntimeLibInfo* info) {
+    const char* libname = strrchr(path, '/');
+    libname = (libname != NULL) ? libname + 1 : path;
+    for (size_t i = 0; i < sizeof(runtimeLibs) / sizeof(runtimeLibs[0]); i++) {
+        if (strcmp(runtimeLibs[i].libName, libname) == 0) {
+            info->lib = &runtimeLibs[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Extract the GNU build ID from the (already mapped) note segments of a library. */
+static void readBuildId(const RuntimeLibInfo* info, char* buildId, size_t size) {
+    buildId[0] = '\0';
+    for (int i = 0; i < info->phnum; i++) {
+        if (info->phdr[i].p_type != PT_NOTE)
+            continue;
+
+        const char* note = (const char*) (info->base + info->phdr[i].p_vaddr);
+        const char* end = note + info->phdr[i].p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr)* nhdr = (const ElfW(Nhdr)*) note;
+            const char* name = note + sizeof(ElfW(Nhdr));
+            const uint8_t* desc = (const uint8_t*) (name + ((nhdr->n_namesz + 3) & ~3));
+            note = (const char*) desc + ((nhdr->n_descsz + 3) & ~3);
+            if (note > end)
+                break;
+
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+                size_t pos = 0;
+                for (size_t j = 0; j < nhdr->n_descsz && pos + 3 <= size; j++)
+                    pos += snprintf(buildId + pos, size - pos, "%02x", desc[j]);
+                return;
+            }
+        }
+    }
+}
+
+#if PLATFORM_SDK_VERSION >= 21
 /** Callback which checks the loaded shared libraries for libdvm/libart. */
-static bool determineRuntime(const char** xposedLibPath) {
+static int findRuntimeLibCallback(struct dl_phdr_info* dlinfo, size_t, void* data) {
+    RuntimeLibInfo* info = (RuntimeLibInfo*) data;
+    if (dlinfo->dlpi_name == NULL || !matchRuntimeLib(dlinfo->dlpi_name, info))
+        return 0;
+
+    info->base = dlinfo->dlpi_addr;
+    info->phdr = dlinfo->dlpi_phdr;
+    info->phnum = dlinfo->dlpi_phnum;
+    return 1;
+}
+#endif
+
+/** Find the runtime library (libart.so/libdvm.so) that has been loaded into this process. */
+static bool findRuntimeLib(RuntimeLibInfo* info) {
+#if PLATFORM_SDK_VERSION >= 21
+    return dl_iterate_phdr(findRuntimeLibCallback, info) != 0;
+#else
+    // dl_iterate_phdr() isn't available on all architectures before Lollipop
     FILE *fp = fopen("/proc/self/maps", "r");
     if (fp == NULL) {
         ALOGE("Could not open /proc/self/maps: %s", strerror(errno));
@@ -362,17 +1106,14 @@ static bool determineRuntime(const char** xposedLibPath) {
         char* libname = strrchr(line, '/');
         if (!libname)
             continue;
-        libname++;
-
-        if (strcmp("libdvm.so\n", libname) == 0) {
-            ALOGI("Detected Dalvik runtime");
-            *xposedLibPath = XPOSED_LIB_DALVIK;
-            success = true;
-            break;
-
-        } else if (strcmp("libart.so\n", libname) == 0) {
-            ALOGI("Detected ART runtime");
-            *xposedLibPath = XPOSED_LIB_ART;
+        libname[strcspn(libname, "\n")] = '\0';
+
+        if (matchRuntimeLib(libname, info)) {
+            // The first mapping of a library starts with its ELF header
+            const ElfW(Ehdr)* ehdr = (const ElfW(Ehdr)*) strtoul(line, NULL, 16);
+            info->base = (uintptr_t) ehdr;
+            info->phdr = (const ElfW(Phdr)*) (info->base + ehdr->e_phoff);
+            info->phnum = ehdr->e_phnum;
             success = true;
             break;
         }
@@ -380,22 +1121,63 @@ static bool determineRuntime(const char** xposedLibPath) {
 
     fclose(fp);
     return success;
+#endif
 }
 
-/** Load the libxposed_*.so library for the currently active runtime. */
-void onVmCreated(JNIEnv* env) {
+/** Determine the currently active runtime and remember some details about it. */
+static bool determineRuntime(const char** xposedLibPath) {
+    RuntimeLibInfo info;
+    memset(&info, 0, sizeof(info));
+    if (!findRuntimeLib(&info))
+        return false;
+
+    xposed->runtimeLibBase = info.base;
+    readBuildId(&info, xposed->runtimeLibBuildId, sizeof(xposed->runtimeLibBuildId));
+
+    ALOGI("Detected %s runtime (base address %#" PRIxPTR ", build ID %s)",
+        info.lib->runtimeName,
+        info.base, xposed->runtimeLibBuildId[0] ? xposed->runtimeLibBuildId : "n/a");
+    *xposedLibPath = info.lib->xposedLibPath;
+    return true;
+}
+
+/** Disable Xposed if the safemode trigger has been detected in the background. */
+static bool checkSafemode() {
+    if (!xposed->zygote || isSafemodeDisabled())
+        return false;
+
+    bool triggered = xposed->startSystemServer ? waitForSafemodeResult() : waitForPrimarySafemodeResult();
+    if (!triggered)
+        return false;
+
+    ALOGI("Safemode triggered, disabling Xposed");
+    disableXposed();
+    return true;
+}
+
+/** Load the libxposed_*.so library for the currently active runtime. Returns false if it couldn't be initialized. */
+static bool loadXposedLib(JNIEnv* env) {
     // Determine the currently active runtime
     const char* xposedLibPath = NULL;
-    if (!determineRuntime(&xposedLibPath)) {
+    bool runtimeFound;
+    {
+        ScopedPhase phase("determineRuntime");
+        runtimeFound = determineRuntime(&xposedLibPath);
+    }
+    if (!runtimeFound) {
         ALOGE("Could not determine runtime, not loading Xposed");
-        return;
+        return false;
     }
 
     // Load the suitable libxposed_*.so for it
-    void* xposedLibHandle = dlopen(xposedLibPath, RTLD_NOW);
+    void* xposedLibHandle;
+    {
+        ScopedPhase phase("dlopen");
+        xposedLibHandle = dlopen(xposedLibPath, RTLD_NOW);
+    }
     if (!xposedLibHandle) {
         ALOGE("Could not load libxposed: %s", dlerror());
-        return;
+        return false;
     }
 
     // Clear previous errors
@@ -406,18 +1188,30 @@ void onVmCreated(JNIEnv* env) {
     *(void **) (&xposedInitLib) = dlsym(xposedLibHandle, "xposedInitLib");
     if (!xposedInitLib)  {
         ALOGE("Could not find function xposedInitLib");
-        return;
+        return false;
     }
 
+    xposed->checkSafemode = &checkSafemode;
+
 #if XPOSED_WITH_SELINUX
     xposed->zygoteservice_accessFile = &service::membased::accessFile;
     xposed->zygoteservice_statFile   = &service::membased::statFile;
     xposed->zygoteservice_readFile   = &service::membased::readFile;
 #endif  // XPOSED_WITH_SELINUX
 
-    if (xposedInitLib(xposed)) {
-        xposed->onVmCreated(env);
-    }
+    if (!xposedInitLib(xposed))
+        return false;
+
+    ScopedPhase phase("onVmCreatedCommon");
+    xposed->onVmCreated(env);
+    return true;
+}
+
+/** Load Xposed into the newly created VM, this is the last step of the startup. */
+void onVmCreated(JNIEnv* env) {
+    if (!loadXposedLib(env))
+        releaseSafemodeDetection();
+    writeTimeline();
 }
 
 /** Set the process name */
@@ -427,47 +1221,140 @@ void setProcessName(const char* name) {
     set_process_name(name);
 }
 
-/** Determine the UID/GID of Xposed Installer. */
-bool determineXposedInstallerUidGid() {
-    if (xposed->isSELinuxEnabled) {
-        struct stat* st = (struct stat*) mmap(NULL, sizeof(struct stat), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-        if (st == MAP_FAILED) {
-            ALOGE("Could not allocate memory in determineXposedInstallerUidGid(): %s", strerror(errno));
-            return false;
+/**
+ * Find the inode of the Xposed Installer data directory and the modification time of its parent.
+ * This only reads the parent directory, which Zygote is allowed to do even with SELinux, so no
+ * context switch is needed. Removing and recreating the directory always changes the parent's
+ * modification time, so a reused inode number doesn't match the key anymore.
+ */
+static bool getInstallerCacheKey(InstallerCache* key) {
+    DIR* dir = opendir(XPOSED_DATA_ROOT);
+    if (dir == NULL)
+        return false;
+
+    struct stat st;
+    bool found = false;
+    if (fstat(dirfd(dir), &st) == 0) {
+        key->parentMtimeNs = (int64_t) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, XPOSED_PACKAGE) == 0) {
+                key->inode = entry->d_ino;
+                found = true;
+                break;
+            }
         }
+    }
 
-        pid_t pid;
-        if ((pid = fork()) < 0) {
-            ALOGE("Fork in determineXposedInstallerUidGid() failed: %s", strerror(errno));
-            munmap(st, sizeof(struct stat));
-            return false;
-        } else if (pid == 0) {
-            // Child.
+    closedir(dir);
+    return found;
+}
+
+/** Use the cached UID/GID if the data directory hasn't been recreated since they were stored. */
+static bool readInstallerCache(const InstallerCache* key) {
+    int fd = open(XPOSED_INSTALLER_CACHE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    InstallerCache cache;
+    ssize_t len = TEMP_FAILURE_RETRY(read(fd, &cache, sizeof(cache)));
+    close(fd);
+    if (len != sizeof(cache) || cache.inode != key->inode || cache.parentMtimeNs != key->parentMtimeNs)
+        return false;
+
+    // Zygote may only stat the directory itself if SELinux doesn't enforce, so double-check there
+    struct stat st;
+    if (!xposed->isSELinuxEnforcing && TEMP_FAILURE_RETRY(stat(XPOSED_DIR, &st)) == 0
+            && (st.st_uid != cache.uid || st.st_gid != cache.gid)) {
+        ALOGW("Cached UID/GID of Xposed Installer (%u/%u) are outdated, rescanning", cache.uid, cache.gid);
+        unlink(XPOSED_INSTALLER_CACHE);
+        return false;
+    }
+
+    xposed->installer_uid = cache.uid;
+    xposed->installer_gid = cache.gid;
+    return true;
+}
+
+static void writeInstallerCache(const InstallerCache* key) {
+    InstallerCache cache;
+    memset(&cache, 0, sizeof(cache));
+    cache.inode = key->inode;
+    cache.parentMtimeNs = key->parentMtimeNs;
+    cache.uid = xposed->installer_uid;
+    cache.gid = xposed->installer_gid;
+
+    int fd = open(XPOSED_INSTALLER_CACHE ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        ALOGE("Could not open %s: %s", XPOSED_INSTALLER_CACHE ".tmp", strerror(errno));
+        return;
+    }
+
+    bool success = TEMP_FAILURE_RETRY(write(fd, &cache, sizeof(cache))) == sizeof(cache);
+    close(fd);
+    if (!success || rename(XPOSED_INSTALLER_CACHE ".tmp", XPOSED_INSTALLER_CACHE) != 0) {
+        ALOGE("Could not write %s: %s", XPOSED_INSTALLER_CACHE, strerror(errno));
+        unlink(XPOSED_INSTALLER_CACHE ".tmp");
+    }
+}
+
+/** Stat the Xposed Installer data directory from a child process in app context. */
+static bool statInstallerDirAsApp(struct stat* result) {
+    struct stat* st = (struct stat*) mmap(NULL, sizeof(struct stat), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (st == MAP_FAILED) {
+        ALOGE("Could not allocate memory in determineXposedInstallerUidGid(): %s", strerror(errno));
+        return false;
+    }
+
+    pid_t pid;
+    if ((pid = fork()) < 0) {
+        ALOGE("Fork in determineXposedInstallerUidGid() failed: %s", strerror(errno));
+        munmap(st, sizeof(struct stat));
+        return false;
+    } else if (pid == 0) {
+        // Child.
 #if XPOSED_WITH_SELINUX
-            if (setcon(ctx_app) != 0) {
-                ALOGE("Could not switch to %s context", ctx_app);
-                exit(EXIT_FAILURE);
-            }
+        if (setcon(ctx_app) != 0) {
+            ALOGE("Could not switch to %s context", ctx_app);
+            exit(EXIT_FAILURE);
+        }
 #endif  // XPOSED_WITH_SELINUX
 
-            if (TEMP_FAILURE_RETRY(stat(XPOSED_DIR, st)) != 0) {
-                ALOGE("Could not stat %s: %s", XPOSED_DIR, strerror(errno));
-                exit(EXIT_FAILURE);
-            }
-
-            exit(EXIT_SUCCESS);
+        if (TEMP_FAILURE_RETRY(stat(XPOSED_DIR, st)) != 0) {
+            ALOGE("Could not stat %s: %s", XPOSED_DIR, strerror(errno));
+            exit(EXIT_FAILURE);
         }
 
-        // Parent.
-        int status;
-        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-            munmap(st, sizeof(struct stat));
+        exit(EXIT_SUCCESS);
+    }
+
+    // Parent.
+    int status;
+    bool success = waitpid(pid, &status, 0) != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (success)
+        memcpy(result, st, sizeof(struct stat));
+    munmap(st, sizeof(struct stat));
+    return success;
+}
+
+/** Determine the UID/GID of Xposed Installer. */
+bool determineXposedInstallerUidGid() {
+    if (xposed->isSELinuxEnabled) {
+        // Forking Zygote is expensive, so try the cache first
+        InstallerCache key;
+        memset(&key, 0, sizeof(key));
+        bool haveKey = getInstallerCacheKey(&key);
+        if (haveKey && readInstallerCache(&key))
+            return true;
+
+        struct stat st;
+        if (!statInstallerDirAsApp(&st))
             return false;
-        }
 
-        xposed->installer_uid = st->st_uid;
-        xposed->installer_gid = st->st_gid;
-        munmap(st, sizeof(struct stat));
+        xposed->installer_uid = st.st_uid;
+        xposed->installer_gid = st.st_gid;
+        if (haveKey)
+            writeInstallerCache(&key);
         return true;
     } else {
         struct stat st;
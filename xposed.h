@@ -3,20 +3,64 @@
 
 #include "xposed_shared.h"
 
+#ifndef XPOSED_PROP_FILE
 #define XPOSED_PROP_FILE "/system/xposed.prop"
+#endif
 
+#ifndef XPOSED_LIB_DIR
 #if defined(__LP64__)
   #define XPOSED_LIB_DIR "/system/lib64/"
 #else
   #define XPOSED_LIB_DIR "/system/lib/"
 #endif
+#endif
 #define XPOSED_LIB_DALVIK        XPOSED_LIB_DIR "libxposed_dalvik.so"
 #define XPOSED_LIB_ART           XPOSED_LIB_DIR "libxposed_art.so"
+#ifndef XPOSED_JAR
 #define XPOSED_JAR               "/system/framework/XposedBridge.jar"
+#endif
 #define XPOSED_JAR_NEWVERSION    XPOSED_DIR "bin/XposedBridge.jar.newversion"
-#define XPOSED_LOAD_BLOCKER      XPOSED_DIR "conf/disabled"
-#define XPOSED_SAFEMODE_NODELAY  XPOSED_DIR "conf/safemode_nodelay"
-#define XPOSED_SAFEMODE_DISABLE  XPOSED_DIR "conf/safemode_disable"
+#define XPOSED_CONF_DIR          XPOSED_DIR "conf/"
+#define XPOSED_LOAD_BLOCKER      XPOSED_CONF_DIR "disabled"
+#define XPOSED_SAFEMODE_NODELAY  XPOSED_CONF_DIR "safemode_nodelay"
+#define XPOSED_SAFEMODE_DISABLE  XPOSED_CONF_DIR "safemode_disable"
+#define XPOSED_JIT_RESET_OFFSET  XPOSED_CONF_DIR "jit_reset_offset"
+#define XPOSED_MODULES_LIST      XPOSED_CONF_DIR "modules.list"
+#define XPOSED_PROCESS_FILTER    XPOSED_CONF_DIR "process_filter"
+#define PROCESS_FILTER_MAX_SIZE  (256*1024)
+
+// Written by the primary Zygote, in a directory that both Zygotes can access
+#ifndef XPOSED_CACHE_DIR
+#define XPOSED_CACHE_DIR         "/data/dalvik-cache/"
+#endif
+#define XPOSED_ZYGOTE_STATE      XPOSED_CACHE_DIR "xposed_zygote.state"
+#define ZYGOTE_WAIT_TIMEOUT      10
+#define ZYGOTE_WAIT_INTERVAL     50
+#define SAFEMODE_WAIT_TIMEOUT    10
+
+// UID/GID of Xposed Installer, valid as long as its data directory isn't recreated
+#define XPOSED_INSTALLER_CACHE   XPOSED_CACHE_DIR "xposed_installer.cache"
+
+// Input devices which reported the keys for the safemode trigger during the last boot
+#define XPOSED_SAFEMODE_DEVICES  XPOSED_CACHE_DIR "xposed_safemode.devices"
+
+// Startup timeline of each Zygote, see ScopedPhase
+#if defined(__LP64__)
+  #define XPOSED_TIMELINE_FILE   XPOSED_CACHE_DIR "xposed_timeline64"
+#else
+  #define XPOSED_TIMELINE_FILE   XPOSED_CACHE_DIR "xposed_timeline32"
+#endif
+#define XPOSED_TIMELINE_PHASES   16
+
+// Rules from xposed.prop (tools.skip=<class> [<arg>|*]...) for tools that shouldn't load Xposed
+#define TOOLS_SKIP_MAX_RULES     32
+#define TOOLS_SKIP_MAX_ARGS      4
+
+// Starts one of the helper processes instead of app_process, see spawnHelper()
+#define XPOSED_HELPER_OPTION     "--xposedhelper"
+#ifndef XPOSED_HELPER_EXE
+#define XPOSED_HELPER_EXE        "/proc/self/exe"
+#endif
 
 #define XPOSED_CLASS_DOTS_ZYGOTE "de.robv.android.xposed.XposedBridge"
 #define XPOSED_CLASS_DOTS_TOOLS  "de.robv.android.xposed.XposedBridge$ToolEntryPoint"
@@ -33,19 +77,58 @@
 
 namespace xposed {
 
+    enum ZygoteStateFlags {
+        ZYGOTE_STATE_READY = 1 << 0,
+        ZYGOTE_STATE_SAFEMODE_DONE = 1 << 1,
+        ZYGOTE_STATE_SAFEMODE_TRIGGERED = 1 << 2,
+    };
+
+    struct ZygoteState {
+        char bootId[40];
+        int32_t primaryPid;
+        uint32_t flags;
+    };
+
+    struct InstallerCache {
+        uint64_t inode;
+        int64_t parentMtimeNs;
+        uint32_t uid;
+        uint32_t gid;
+    };
+
+    /** Measures a startup phase for the timeline and wraps it in an atrace section. */
+    class ScopedPhase {
+      public:
+        explicit ScopedPhase(const char* name);
+        ~ScopedPhase();
+
+      private:
+        int index;
+    };
+
     bool handleOptions(int argc, char* const argv[]);
-    bool initialize(bool zygote, bool startSystemServer, const char* className, int argc, char* const argv[]);
+    bool initialize(bool zygote, bool startSystemServer, const char* className, int argc, char* const argv[],
+                    int firstToolArg);
+    void setPrimaryZygoteReady(bool ready);
+    void waitForPrimaryZygote();
+    void setSafemodeResult(bool triggered);
     void printRomInfo();
     void parseXposedProp();
     int getSdkVersion();
+    void readConfig(XposedConfig* config);
+    void loadConfig();
+    void loadProcessFilter();
     bool isDisabled();
     void disableXposed();
     bool isSafemodeDisabled();
     bool shouldSkipSafemodeDelay();
     bool shouldIgnoreCommand(int argc, const char* const argv[]);
+    bool shouldSkipTool(const char* className, int toolArgc, const char* const toolArgv[]);
     bool addJarToClasspath();
+    void prefetchModules();
     void onVmCreated(JNIEnv* env);
     void setProcessName(const char* name);
+    pid_t spawnHelper(const char* name, int fd = -1, const char* arg = NULL);
     bool determineXposedInstallerUidGid();
     bool switchToXposedInstallerUidGid();
     void dropCapabilities(int8_t keep[] = NULL);
@@ -7,13 +7,26 @@
 #include <cstring>
 #include <errno.h>
 #include <fcntl.h>
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "xposed.h"
 #include "xposed_service.h"
 #include "xposed_logcat.h"
+#include "xposed_stats.h"
 
 
 namespace xposed {
@@ -27,6 +40,310 @@ namespace logcat {
 #define CAP_SYSLOG   34
 char marker[50];
 
+struct DaemonStats {
+    uint64_t lines;         // lines read from logcat
+    uint64_t bytes;         // bytes read from logcat
+    uint64_t reads;         // read() calls on the pipe
+    uint64_t writes;        // write() calls for the log, the index and the tail
+    uint64_t dropped;       // lines that were not written due to repetitions or rate limits
+};
+
+struct LineReader {
+    int fd;
+    size_t pos;
+    size_t len;
+    char buf[16*1024];
+};
+
+struct LogWriter {
+    int logfile;
+    int indexfile;
+    long maxSize;
+    long totalSize;
+    long totalLines;
+    long indexedLines;
+    time_t indexedTime;
+    DaemonStats stats;
+};
+
+struct CaptureState {
+    int pipefd;
+    pid_t logcatPid;
+    LogWriter writer;
+};
+
+struct RepeatState {
+    char line[512];         // last line that was written
+    int keyOffset;          // start of the line without the timestamp
+    int repeats;            // number of identical lines that were skipped since then
+    time_t firstRepeat;     // time of the first skipped line
+};
+
+struct TagBucket {
+    char tag[32];
+    long tokens;            // in 1/1000 lines
+    long lastRefill;        // in ms
+    int suppressed;
+};
+
+struct RateLimiter {
+    long rate;              // lines per second for each tag, 0 if disabled
+    long burst;             // maximum number of lines in a burst
+    TagBucket buckets[LOG_RATELIMIT_TAGS];
+};
+
+struct TailRing {
+    pthread_mutex_t mutex;
+    char data[LOG_TAIL_RING_SIZE];
+    uint64_t head;          // total number of bytes ever written to the ring
+    int clients;            // number of connected clients, nothing is copied without them
+    int wakeFd;             // written to when new data is available
+};
+
+struct TailClient {
+    int fd;
+    uint64_t pos;           // position in the ring up to which data has been sent
+};
+
+static TailRing* tailRing = NULL;
+
+struct BenchConfig {
+    long rate;              // lines per second, 0 for unlimited
+    long seconds;
+    int minLength;
+    int maxLength;
+    int repeatPercent;      // probability that a line is identical to the previous one
+};
+
+struct BenchResult {
+    uint64_t lines;         // lines written to the pipe
+    uint64_t bytes;
+    uint64_t droppedLines;  // lines that couldn't be written because the pipe was full
+    uint64_t droppedBytes;
+};
+
+
+////////////////////////////////////////////////////////////
+// Live log tail
+////////////////////////////////////////////////////////////
+
+/**
+ * Copies new log data into the ring and wakes up the tail server. Never blocks on clients.
+ * Returns true if the tail server had to be woken up, i.e. if any clients are connected.
+ */
+static bool appendToTail(const char* buf, int len) {
+    if (tailRing == NULL)
+        return false;
+
+    pthread_mutex_lock(&tailRing->mutex);
+    if (tailRing->clients == 0) {
+        // New clients only receive lines that are written after they connected
+        pthread_mutex_unlock(&tailRing->mutex);
+        return false;
+    }
+    for (int i = 0; i < len; ) {
+        size_t pos = tailRing->head % LOG_TAIL_RING_SIZE;
+        size_t chunk = LOG_TAIL_RING_SIZE - pos;
+        if (chunk > (size_t) (len - i))
+            chunk = len - i;
+        memcpy(tailRing->data + pos, buf + i, chunk);
+        tailRing->head += chunk;
+        i += chunk;
+    }
+    pthread_mutex_unlock(&tailRing->mutex);
+
+    // The pipe is non-blocking, if it's full the server will wake up anyway
+    char c = 0;
+    write(tailRing->wakeFd, &c, 1);
+    return true;
+}
+
+/** Sends pending data to a client. Returns false if the client should be disconnected. */
+static bool sendToTailClient(TailClient* client) {
+    char buf[4096];
+    size_t len = 0;
+    uint64_t skipped = 0;
+
+    pthread_mutex_lock(&tailRing->mutex);
+    if (tailRing->head - client->pos > LOG_TAIL_RING_SIZE) {
+        // The client was too slow, the data it didn't receive has already been overwritten
+        skipped = tailRing->head - client->pos;
+        client->pos = tailRing->head;
+    } else {
+        size_t pos = client->pos % LOG_TAIL_RING_SIZE;
+        len = tailRing->head - client->pos;
+        if (len > LOG_TAIL_RING_SIZE - pos)
+            len = LOG_TAIL_RING_SIZE - pos;
+        if (len > sizeof(buf))
+            len = sizeof(buf);
+        memcpy(buf, tailRing->data + pos, len);
+    }
+    pthread_mutex_unlock(&tailRing->mutex);
+
+    if (skipped > 0) {
+        len = snprintf(buf, sizeof(buf), "\n--- skipped %" PRIu64 " bytes\n", skipped);
+        // Best effort only, there is no way to resume in the middle of this message
+        send(client->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        return true;
+    }
+
+    ssize_t sent = send(client->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+    client->pos += sent;
+    return true;
+}
+
+static void* tailServer(void* arg) {
+    int* fds = (int*) arg;
+    int serverFd = fds[0];
+    int wakeFd = fds[1];
+    free(fds);
+
+    TailClient clients[LOG_TAIL_MAX_CLIENTS];
+    int clientCount = 0;
+    struct pollfd pfds[LOG_TAIL_MAX_CLIENTS + 2];
+
+    while (true) {
+        uint64_t head;
+        pthread_mutex_lock(&tailRing->mutex);
+        head = tailRing->head;
+        pthread_mutex_unlock(&tailRing->mutex);
+
+        pfds[0].fd = serverFd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = wakeFd;
+        pfds[1].events = POLLIN;
+        for (int i = 0; i < clientCount; i++) {
+            pfds[i + 2].fd = clients[i].fd;
+            // Clients are not expected to send anything, POLLIN only detects disconnects
+            pfds[i + 2].events = POLLIN | ((clients[i].pos < head) ? POLLOUT : 0);
+        }
+
+        if (poll(pfds, clientCount + 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            ALOGE("poll() failed in log tail server: %s", strerror(errno));
+            break;
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(wakeFd, drain, sizeof(drain)) > 0) {}
+        }
+
+        for (int i = clientCount - 1; i >= 0; i--) {
+            short revents = pfds[i + 2].revents;
+            bool keep = true;
+            if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                keep = false;
+            } else if (revents & POLLIN) {
+                char discard[64];
+                keep = recv(clients[i].fd, discard, sizeof(discard), MSG_DONTWAIT) > 0;
+            }
+            if (keep && (revents & POLLOUT))
+                keep = sendToTailClient(&clients[i]);
+
+            if (!keep) {
+                close(clients[i].fd);
+                clients[i] = clients[--clientCount];
+                pthread_mutex_lock(&tailRing->mutex);
+                tailRing->clients = clientCount;
+                pthread_mutex_unlock(&tailRing->mutex);
+            }
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            int fd = accept(serverFd, NULL, NULL);
+            if (fd < 0)
+                continue;
+            if (clientCount >= LOG_TAIL_MAX_CLIENTS) {
+                close(fd);
+                continue;
+            }
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            // New clients receive only lines that are written after they connected
+            clients[clientCount].fd = fd;
+            pthread_mutex_lock(&tailRing->mutex);
+            clients[clientCount].pos = tailRing->head;
+            tailRing->clients = ++clientCount;
+            pthread_mutex_unlock(&tailRing->mutex);
+        }
+    }
+
+    for (int i = 0; i < clientCount; i++)
+        close(clients[i].fd);
+    close(serverFd);
+    return NULL;
+}
+
+/** Starts a thread that pushes new log lines to clients connected to XPOSEDLOG_TAIL_SOCKET. */
+static void startTailServer() {
+    int serverFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (serverFd < 0) {
+        ALOGE("Could not create socket for log tail: %s", strerror(errno));
+        return;
+    }
+    fcntl(serverFd, F_SETFD, FD_CLOEXEC);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, XPOSEDLOG_TAIL_SOCKET, sizeof(addr.sun_path));
+    unlink(XPOSEDLOG_TAIL_SOCKET);
+
+    // The daemon runs with umask 0, the socket must never be accessible for other apps
+    mode_t oldUmask = umask(077);
+    int err = bind(serverFd, (struct sockaddr*) &addr, sizeof(addr));
+    umask(oldUmask);
+    if (err != 0 || listen(serverFd, LOG_TAIL_MAX_CLIENTS) != 0) {
+        ALOGE("Could not listen on %s: %s", XPOSEDLOG_TAIL_SOCKET, strerror(errno));
+        close(serverFd);
+        return;
+    }
+
+    int wakePipe[2];
+    if (pipe(wakePipe) != 0) {
+        ALOGE("Could not create pipe for log tail: %s", strerror(errno));
+        close(serverFd);
+        return;
+    }
+    fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+
+    TailRing* ring = (TailRing*) calloc(1, sizeof(TailRing));
+    int* fds = (int*) malloc(2 * sizeof(int));
+    if (ring == NULL || fds == NULL) {
+        ALOGE("Could not allocate memory for log tail");
+        free(ring);
+        free(fds);
+        close(serverFd);
+        close(wakePipe[0]);
+        close(wakePipe[1]);
+        return;
+    }
+    pthread_mutex_init(&ring->mutex, NULL);
+    ring->wakeFd = wakePipe[1];
+    fds[0] = serverFd;
+    fds[1] = wakePipe[0];
+    tailRing = ring;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &tailServer, fds) != 0) {
+        ALOGE("Could not create thread for log tail: %s", strerror(errno));
+        tailRing = NULL;
+        pthread_mutex_destroy(&ring->mutex);
+        free(ring);
+        free(fds);
+        close(serverFd);
+        close(wakePipe[0]);
+        close(wakePipe[1]);
+        return;
+    }
+    pthread_detach(thread);
+}
+
 
 ////////////////////////////////////////////////////////////
 // Functions
@@ -36,13 +353,13 @@ static void execLogcat() {
     int8_t keep[] = { CAP_SYSLOG, -1 };
     xposed::dropCapabilities(keep);
 
-    // Execute a logcat command that will keep running in the background
-    if (zygote_access(XPOSEDLOG_CONF_ALL, F_OK) == 0) {
-        execl("/system/bin/logcat", "logcat",
+    // Execute a logcat command that will keep running in the background.
+    if (xposed->config.logAll) {
+        execl(XPOSEDLOG_LOGCAT, "logcat",
             "-v", "time",            // include timestamps in the log
             (char*) 0);
     } else {
-        execl("/system/bin/logcat", "logcat",
+        execl(XPOSEDLOG_LOGCAT, "logcat",
             "-v", "time",            // include timestamps in the log
             "-s",                    // be silent by default, except for the following tags
             "XposedStartupMarker:D", // marks the beginning of the current log
@@ -73,104 +390,619 @@ static inline int dprintf(int fd, const char *format, ...) {
 }
 #endif
 
-static void runDaemon(int pipefd) {
-    xposed::setProcessName("xposed_logcat");
-    xposed::dropCapabilities();
+static void writeIndexEntry(int indexfile, LogIndexType type, time_t now, long offset, long lines) {
+    if (indexfile < 0)
+        return;
 
-    umask(0);
-    int logfile = open(XPOSEDLOG, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-    if (logfile < 0) {
-        ALOGE("Could not open %s: %s", XPOSEDLOG, strerror(errno));
-        exit(EXIT_FAILURE);
+    struct LogIndexEntry entry;
+    entry.time = now;
+    entry.offset = offset;
+    entry.line = lines;
+    entry.type = type;
+    if (write(indexfile, &entry, sizeof(entry)) != sizeof(entry)) {
+        ALOGE("Could not write to %s: %s", XPOSEDLOG_INDEX, strerror(errno));
+    }
+}
+
+/** Returns false when the maximum log size has been reached. */
+static bool writeLog(LogWriter* writer, const char* buf, int len) {
+    write(writer->logfile, buf, len);
+    writer->stats.writes++;
+    if (appendToTail(buf, len))
+        writer->stats.writes++;
+
+    writer->totalSize += len;
+
+    // Record checkpoints at line boundaries, so readers can start reading from there
+    if (buf[len - 1] == '\n') {
+        writer->totalLines++;
+        time_t now = time(NULL);
+        if (writer->totalLines - writer->indexedLines >= XPOSEDLOG_INDEX_LINES
+                || now - writer->indexedTime >= XPOSEDLOG_INDEX_INTERVAL) {
+            writer->indexedTime = now;
+            writer->indexedLines = writer->totalLines;
+            writeIndexEntry(writer->indexfile, LOG_INDEX_CHECKPOINT, now, writer->totalSize, writer->totalLines);
+            writer->stats.writes++;
+        }
+    }
+
+    if (writer->totalSize > writer->maxSize) {
+        dprintf(writer->logfile, "\nReached maximum log size (%'d kB), further lines won't be logged.\n", XPOSEDLOG_MAX_SIZE / 1024);
+        return false;
+    }
+    return true;
+}
+
+/** Returns the offset of the part after the "MM-DD HH:MM:SS.mmm " prefix of a log line. */
+static int skipTimestamp(const char* buf) {
+    const char* p = strchr(buf, ' ');
+    if (p != NULL)
+        p = strchr(p + 1, ' ');
+    return (p != NULL) ? (p + 1 - buf) : 0;
+}
+
+/** Writes the summary for repeated lines, if there were any. Returns false when the log is full. */
+static bool flushRepeats(LogWriter* writer, RepeatState* repeat) {
+    if (repeat->repeats == 0)
+        return true;
+
+    char summary[128];
+    int len = snprintf(summary, sizeof(summary), "%.*s(previous line repeated %d times)\n",
+            repeat->keyOffset, repeat->line, repeat->repeats);
+    if (len >= (int) sizeof(summary))
+        len = sizeof(summary) - 1;
+    repeat->repeats = 0;
+    return writeLog(writer, summary, len);
+}
+
+/**
+ * Returns true if the line is identical to the last written one, ignoring the timestamp.
+ * Otherwise, pending repetitions are reported. For long loops, the summary is also written
+ * from time to time. *full is set if the log became full while writing the summary.
+ */
+static bool isRepeatedLine(LogWriter* writer, RepeatState* repeat, const char* buf, bool* full) {
+    int keyOffset = skipTimestamp(buf);
+    if (repeat->line[0] != 0 && strcmp(buf + keyOffset, repeat->line + repeat->keyOffset) == 0) {
+        // Keep the latest timestamp for the summary
+        memcpy(repeat->line, buf, keyOffset);
+        repeat->keyOffset = keyOffset;
+        time_t now = time(NULL);
+        if (repeat->repeats++ == 0)
+            repeat->firstRepeat = now;
+        if (repeat->repeats >= XPOSEDLOG_REPEAT_LINES || now - repeat->firstRepeat >= XPOSEDLOG_REPEAT_INTERVAL)
+            *full = !flushRepeats(writer, repeat);
+        return true;
     }
 
-    FILE* pipe = fdopen(pipefd, "r");
-    if (pipe == NULL) {
-        ALOGE("fdopen failed for pipe file descriptor %d: %s", pipefd, strerror(errno));
-        exit(EXIT_FAILURE);
+    *full = !flushRepeats(writer, repeat);
+    return false;
+}
+
+/** Sets the line to compare the following ones with, or clears it if the line wasn't written. */
+static void rememberLine(RepeatState* repeat, const char* buf, int len, bool written) {
+    // Long lines are split into several chunks, only complete lines are compared
+    if (!written || buf[len - 1] != '\n') {
+        repeat->line[0] = 0;
+        repeat->keyOffset = 0;
+        return;
     }
 
+    memcpy(repeat->line, buf, len + 1);
+    repeat->keyOffset = skipTimestamp(buf);
+}
+
+static void initRateLimiter(RateLimiter* limiter) {
+    memset(limiter, 0, sizeof(RateLimiter));
+    limiter->rate = xposed->config.logRateLimit;
+    limiter->burst = xposed->config.logRateBurst;
+}
+
+/**
+ * Finds the bucket for the tag in a "D/Tag( 1234): ..." line, creating one if necessary.
+ * Returns NULL if the tag can't be determined or too many different tags have been seen.
+ */
+static TagBucket* findTagBucket(RateLimiter* limiter, const char* buf) {
+    const char* tag = strchr(buf, '/');
+    if (tag == NULL)
+        return NULL;
+    tag++;
+    const char* tagEnd = strchr(tag, '(');
+    if (tagEnd == NULL)
+        return NULL;
+    while (tagEnd > tag && tagEnd[-1] == ' ')
+        tagEnd--;
+
+    size_t len = tagEnd - tag;
+    if (len >= sizeof(TagBucket::tag))
+        len = sizeof(TagBucket::tag) - 1;
+
+    unsigned int hash = 0;
+    for (size_t i = 0; i < len; i++)
+        hash = hash * 31 + (unsigned char) tag[i];
+
+    for (int i = 0; i < LOG_RATELIMIT_TAGS; i++) {
+        TagBucket* bucket = &limiter->buckets[(hash + i) % LOG_RATELIMIT_TAGS];
+        if (bucket->tag[0] == 0) {
+            memcpy(bucket->tag, tag, len);
+            bucket->tag[len] = 0;
+            bucket->tokens = limiter->burst * 1000;
+            bucket->lastRefill = -1;
+            return bucket;
+        } else if (strncmp(bucket->tag, tag, len) == 0 && bucket->tag[len] == 0) {
+            return bucket;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Returns true if the line should be written, based on the token bucket for its tag.
+ * *full is set if the log became full while writing the summary for suppressed lines.
+ */
+static bool checkRateLimit(LogWriter* writer, RateLimiter* limiter, const char* buf, bool* full) {
+    if (limiter->rate == 0)
+        return true;
+
+    TagBucket* bucket = findTagBucket(limiter, buf + skipTimestamp(buf));
+    if (bucket == NULL)
+        return true;
+
+    long now = monotonicNs() / 1000000;
+    if (bucket->lastRefill >= 0) {
+        bucket->tokens += (now - bucket->lastRefill) * limiter->rate;
+        if (bucket->tokens > limiter->burst * 1000)
+            bucket->tokens = limiter->burst * 1000;
+    }
+    bucket->lastRefill = now;
+
+    if (bucket->tokens < 1000) {
+        bucket->suppressed++;
+        return false;
+    }
+    bucket->tokens -= 1000;
+
+    if (bucket->suppressed > 0) {
+        char summary[128];
+        int len = snprintf(summary, sizeof(summary), "%.*s(suppressed %d lines with tag %s)\n",
+                skipTimestamp(buf), buf, bucket->suppressed, bucket->tag);
+        if (len >= (int) sizeof(summary))
+            len = sizeof(summary) - 1;
+        bucket->suppressed = 0;
+        if (!writeLog(writer, summary, len)) {
+            *full = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads a line like fgets(), but with a larger buffer to reduce the number of read() calls.
+ * Returns the length of the line, 0 at the end of the input or -1 in case of errors.
+ */
+static int readLine(LineReader* reader, char* out, int size, DaemonStats* stats) {
+    int len = 0;
+    while (len < size - 1) {
+        if (reader->pos == reader->len) {
+            ssize_t bytesRead = TEMP_FAILURE_RETRY(read(reader->fd, reader->buf, sizeof(reader->buf)));
+            stats->reads++;
+            if (bytesRead <= 0) {
+                if (len > 0)
+                    break;
+                return bytesRead;
+            }
+            reader->pos = 0;
+            reader->len = bytesRead;
+        }
+
+        const char* start = reader->buf + reader->pos;
+        size_t available = reader->len - reader->pos;
+        const char* newline = (const char*) memchr(start, '\n', available);
+        size_t chunk = (newline != NULL) ? (newline + 1 - start) : available;
+        if (chunk > (size_t) (size - 1 - len))
+            chunk = size - 1 - len;
+
+        memcpy(out + len, start, chunk);
+        len += chunk;
+        reader->pos += chunk;
+        if (out[len - 1] == '\n')
+            break;
+    }
+    out[len] = 0;
+    return len;
+}
+
+/** Writes the lines read from logcat to the log until the pipe is closed. Returns the error, if any. */
+static int processLog(int pipefd, LogWriter* writer) {
+    LineReader* reader = (LineReader*) malloc(sizeof(LineReader));
+    if (reader == NULL)
+        return ENOMEM;
+    reader->fd = pipefd;
+    reader->pos = 0;
+    reader->len = 0;
+
+    RepeatState repeat;
+    memset(&repeat, 0, sizeof(repeat));
+    RateLimiter limiter;
+    initRateLimiter(&limiter);
+
     char buf[512];
+    int len;
     bool foundMarker = false;
-    long totalSize = 0;
-    while (fgets(buf, sizeof(buf), pipe) != NULL) {
+    bool partial = false;
+    bool dropLine = false;
+    bool full = false;
+    while (!full && (len = readLine(reader, buf, sizeof(buf), &writer->stats)) > 0) {
+        writer->stats.bytes += len;
+        stats::add(stats::STATS_LOG_BYTES, len);
+        if (buf[len - 1] == '\n') {
+            writer->stats.lines++;
+            stats::add(stats::STATS_LOG_LINES);
+        }
+
         if (buf[0] == '-')
             continue; // beginning of <logbuffer type>
 
         if (!foundMarker) {
             if (strstr(buf, "XposedStartupMarker") != NULL && strstr(buf, marker) != NULL) {
                 foundMarker = true;
+                writer->indexedTime = time(NULL);
+                writeIndexEntry(writer->indexfile, LOG_INDEX_BOOT, writer->indexedTime, 0, 0);
             }
             continue;
         }
 
-        int len = strlen(buf);
-        write(logfile, buf, len);
+        bool continuation = partial;
+        partial = (buf[len - 1] != '\n');
+        if (continuation) {
+            // Remaining part of a long line, handle it like the beginning
+            if (!dropLine)
+                full = !writeLog(writer, buf, len);
+            continue;
+        }
 
-        totalSize += len;
-        if (totalSize > XPOSEDLOG_MAX_SIZE) {
-            dprintf(logfile, "\nReached maximum log size (%'d kB), further lines won't be logged.\n", XPOSEDLOG_MAX_SIZE / 1024);
-            exit(EXIT_FAILURE);
+        if (isRepeatedLine(writer, &repeat, buf, &full)) {
+            writer->stats.dropped++;
+            stats::add(stats::STATS_LOG_DROPPED);
+            continue;
+        } else if (full) {
+            break;
         }
+
+        dropLine = !checkRateLimit(writer, &limiter, buf, &full);
+        if (full) {
+            break;
+        } else if (dropLine) {
+            writer->stats.dropped++;
+            stats::add(stats::STATS_LOG_DROPPED);
+        } else {
+            full = !writeLog(writer, buf, len);
+        }
+        rememberLine(&repeat, buf, len, !dropLine);
     }
 
-    ALOGE("Broken pipe to logcat: %s", strerror(ferror(pipe)));
-    close(logfile);
-    exit(EXIT_FAILURE);
+    int err = (len < 0) ? errno : 0;
+    if (!full)
+        full = !flushRepeats(writer, &repeat);
+    if (full)
+        err = EFBIG;
+    free(reader);
+    return err;
 }
 
-void printStartupMarker() {
-    sprintf(marker, "Current time: %d, PID: %d", (int) time(NULL), getpid());
-    ALOG(LOG_DEBUG, "XposedStartupMarker", marker, NULL);
+static bool openLogFiles(LogWriter* writer, const char* logPath, const char* indexPath) {
+    memset(writer, 0, sizeof(LogWriter));
+    writer->maxSize = XPOSEDLOG_MAX_SIZE;
+    writer->logfile = open(logPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if (writer->logfile < 0) {
+        ALOGE("Could not open %s: %s", logPath, strerror(errno));
+        return false;
+    }
+
+    // The index is only an optimization for readers, so continue without it in case of errors
+    writer->indexfile = open(indexPath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if (writer->indexfile < 0) {
+        ALOGE("Could not open %s: %s", indexPath, strerror(errno));
+    }
+    return true;
+}
+
+static void closeLogFiles(LogWriter* writer) {
+    close(writer->logfile);
+    if (writer->indexfile >= 0)
+        close(writer->indexfile);
+}
+
+/** Terminates logcat (by closing the pipe) and releases the resources used for capturing its output. */
+static void stopCapture(CaptureState* capture) {
+    close(capture->pipefd);
+    waitpid(capture->logcatPid, NULL, 0);
+    closeLogFiles(&capture->writer);
+    free(capture);
+}
+
+/** Runs in the Xposed daemon, other threads serve the binder and Zygote services. */
+static void* captureThread(void* arg) {
+    CaptureState* capture = (CaptureState*) arg;
+    int err = processLog(capture->pipefd, &capture->writer);
+    if (err == EFBIG)
+        ALOGW("Log file has reached its maximum size, stopped capturing");
+    else
+        ALOGE("Broken pipe to logcat: %s", strerror(err));
+    stopCapture(capture);
+    return NULL;
 }
 
-void start() {
-    // Fork to create a daemon
-    pid_t pid;
-    if ((pid = fork()) < 0) {
-        ALOGE("Fork for Xposed logcat daemon failed: %s", strerror(errno));
+/**
+ * Returns the offset in XPOSEDLOG from which all lines written at or after the given time
+ * (in seconds since the epoch) can be read, using the checkpoints in XPOSEDLOG_INDEX.
+ * Falls back to the beginning of the log if there is no index.
+ */
+int64_t findLogOffset(int64_t since) {
+    int fd = open(XPOSEDLOG_INDEX, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(LogIndexEntry)) {
+        close(fd);
+        return 0;
+    }
+
+    size_t count = st.st_size / sizeof(LogIndexEntry);
+    LogIndexEntry* entries = (LogIndexEntry*) malloc(count * sizeof(LogIndexEntry));
+    if (entries == NULL) {
+        close(fd);
+        return 0;
+    }
+
+    ssize_t bytesRead = TEMP_FAILURE_RETRY(read(fd, entries, count * sizeof(LogIndexEntry)));
+    close(fd);
+    if (bytesRead < (ssize_t) sizeof(LogIndexEntry)) {
+        free(entries);
+        return 0;
+    }
+    count = bytesRead / sizeof(LogIndexEntry);
+
+    // Find the last checkpoint that was written before the requested time.
+    // Lines after it might be older than requested, but none of the newer ones are skipped.
+    int64_t offset = 0;
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (entries[mid].time < since) {
+            offset = entries[mid].offset;
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    free(entries);
+    return offset;
+}
+
+////////////////////////////////////////////////////////////
+// Benchmark
+////////////////////////////////////////////////////////////
+
+/** Writes synthetic logcat output to the pipe, like logcat would do without ever blocking. */
+static void generateLines(int fd, int resultFd, const BenchConfig* config) {
+    static const char* tags[] = { "Xposed", "XposedInstaller", "ModuleA", "ModuleB", "ModuleC", "art" };
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    BenchResult result;
+    memset(&result, 0, sizeof(result));
+    unsigned int seed = getpid();
+    pid_t pid = getpid();
+
+    char line[512];
+    int len = snprintf(line, sizeof(line), "01-01 00:00:00.000 D/XposedStartupMarker(%5d): %s\n", pid, marker);
+    TEMP_FAILURE_RETRY(write(fd, line, len));
+
+    char payload[512];
+    int payloadLength = 0;
+    const char* tag = tags[0];
+    uint64_t generated = 0;
+    long start = monotonicNs() / 1000000;
+    long now = start;
+    while (now - start < config->seconds * 1000) {
+        uint64_t target = (config->rate > 0) ? (uint64_t) (now - start) * config->rate / 1000 : generated + 64;
+        for (; generated < target; generated++) {
+            if (payloadLength == 0 || (int) (rand_r(&seed) % 100) >= config->repeatPercent) {
+                tag = tags[rand_r(&seed) % (sizeof(tags) / sizeof(tags[0]))];
+                payloadLength = config->minLength;
+                if (config->maxLength > config->minLength)
+                    payloadLength += rand_r(&seed) % (config->maxLength - config->minLength + 1);
+                for (int i = 0; i < payloadLength; i++)
+                    payload[i] = 'a' + rand_r(&seed) % 26;
+            }
+
+            long elapsed = now - start;
+            len = snprintf(line, sizeof(line), "01-01 00:%02ld:%02ld.%03ld I/%-8s(%5d): %.*s\n",
+                    (elapsed / 60000) % 60, (elapsed / 1000) % 60, elapsed % 1000, tag, pid, payloadLength, payload);
+            if (len >= (int) sizeof(line)) {
+                len = sizeof(line) - 1;
+                line[len - 1] = '\n';
+            }
+
+            // Writes up to PIPE_BUF bytes are atomic, so they either succeed completely or fail
+            if (TEMP_FAILURE_RETRY(write(fd, line, len)) == len) {
+                result.lines++;
+                result.bytes += len;
+            } else {
+                result.droppedLines++;
+                result.droppedBytes += len;
+            }
+        }
+
+        if (config->rate > 0)
+            usleep(1000);
+        now = monotonicNs() / 1000000;
+    }
+
+    close(fd);
+    TEMP_FAILURE_RETRY(write(resultFd, &result, sizeof(result)));
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * Feeds synthetic logcat output through the same code as the daemon and reports the throughput.
+ * Arguments: [lines per second, 0 = unlimited] [seconds] [min length] [max length] [repeated lines in %]
+ */
+void runBenchmark(int argc, char* const argv[]) {
+    BenchConfig config;
+    config.rate = (argc > 0) ? atol(argv[0]) : 0;
+    config.seconds = (argc > 1) ? atol(argv[1]) : 5;
+    config.minLength = (argc > 2) ? atoi(argv[2]) : 40;
+    config.maxLength = (argc > 3) ? atoi(argv[3]) : 200;
+    config.repeatPercent = (argc > 4) ? atoi(argv[4]) : 0;
+    if (config.seconds <= 0)
+        config.seconds = 5;
+    if (config.minLength < 1)
+        config.minLength = 1;
+    if (config.maxLength > 400)
+        config.maxLength = 400;
+    if (config.maxLength < config.minLength)
+        config.maxLength = config.minLength;
+
+    printf("Rate: %ld lines/s%s, duration: %ld s, line length: %d-%d, repeated lines: %d%%\n",
+        config.rate, (config.rate > 0) ? "" : " (unlimited)", config.seconds,
+        config.minLength, config.maxLength, config.repeatPercent);
+
+    snprintf(marker, sizeof(marker), "Benchmark, PID: %d", getpid());
+
+    int pipeFds[2], resultFds[2];
+    if (pipe(pipeFds) < 0 || pipe(resultFds) < 0) {
+        printf("Could not create pipes: %s\n", strerror(errno));
         return;
-    } else if (pid != 0) {
+    }
+    fcntl(pipeFds[0], F_SETPIPE_SZ, 1048576);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("Fork failed: %s\n", strerror(errno));
         return;
+    } else if (pid == 0) {
+        close(pipeFds[0]);
+        close(resultFds[0]);
+        generateLines(pipeFds[1], resultFds[1], &config);
     }
+    close(pipeFds[1]);
+    close(resultFds[1]);
+
+    LogWriter writer;
+    if (!openLogFiles(&writer, XPOSEDLOG_BENCH_FILE, XPOSEDLOG_BENCH_FILE ".idx")) {
+        printf("Could not open %s: %s\n", XPOSEDLOG_BENCH_FILE, strerror(errno));
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return;
+    }
+    writer.maxSize = LONG_MAX;
+
+    long start = monotonicNs() / 1000000;
+    int err = processLog(pipeFds[0], &writer);
+    long elapsed = monotonicNs() / 1000000 - start;
+    if (elapsed <= 0)
+        elapsed = 1;
+
+    BenchResult result;
+    memset(&result, 0, sizeof(result));
+    TEMP_FAILURE_RETRY(read(resultFds[0], &result, sizeof(result)));
+    waitpid(pid, NULL, 0);
+    close(pipeFds[0]);
+    close(resultFds[0]);
+    closeLogFiles(&writer);
+    unlink(XPOSEDLOG_BENCH_FILE);
+    unlink(XPOSEDLOG_BENCH_FILE ".idx");
 
-    // Ensure that we're allowed to read all log entries
+    if (err != 0)
+        printf("Error while reading from the pipe: %s\n", strerror(err));
+
+    const DaemonStats& stats = writer.stats;
+    double lines = (stats.lines > 0) ? stats.lines : 1;
+    printf("Processed %" PRIu64 " lines (%" PRIu64 " bytes) in %ld ms\n", stats.lines, stats.bytes, elapsed);
+    printf("Throughput: %.0f lines/s, %.0f kB/s\n",
+        stats.lines * 1000.0 / elapsed, stats.bytes * 1000.0 / 1024 / elapsed);
+    printf("Syscalls: %.3f per line (%" PRIu64 " reads, %" PRIu64 " writes)\n",
+        (stats.reads + stats.writes) / lines, stats.reads, stats.writes);
+    printf("Dropped: %" PRIu64 " lines (%" PRIu64 " bytes) while the pipe was full, %" PRIu64 " lines filtered\n",
+        result.droppedLines, result.droppedBytes, stats.dropped);
+}
+
+////////////////////////////////////////////////////////////
+// Startup
+////////////////////////////////////////////////////////////
+
+void printStartupMarker() {
+    sprintf(marker, "Current time: %d, PID: %d", (int) time(NULL), getpid());
+    ALOG(LOG_DEBUG, "XposedStartupMarker", marker, NULL);
+}
+
+/** The daemon needs the marker to find the start of the current boot in the logcat output. */
+const char* getStartupMarker() {
+    return marker;
+}
+
+/** Allow the logcat process which is started later to read all log entries. Must be called before switching the UID. */
+void retainLogAccess() {
     if (prctl(PR_SET_KEEPCAPS, 1, 0, 0, 0) < 0) {
         ALOGE("Failed to keep capabilities: %s", strerror(errno));
     }
     const gid_t groups[] = { AID_LOG };
     setgroups(1, groups);
-    if (!xposed::switchToXposedInstallerUidGid()) {
-        exit(EXIT_FAILURE);
-    }
+}
 
-#if XPOSED_WITH_SELINUX
-    if (xposed->isSELinuxEnabled) {
-        if (setcon(ctx_app) != 0) {
-            ALOGE("Could not switch to %s context", ctx_app);
-            exit(EXIT_FAILURE);
-        }
-    }
-#endif  // XPOSED_WITH_SELINUX
+/**
+ * Start logcat and a thread in the daemon which writes its output to the log file.
+ * Logcat is forked, so this has to be called before any other threads are started.
+ */
+bool startCapture(const char* startupMarker) {
+    if (startupMarker != NULL)
+        snprintf(marker, sizeof(marker), "%s", startupMarker);
 
     int err = rename(XPOSEDLOG, XPOSEDLOG_OLD);
     if (err < 0 && errno != ENOENT) {
         ALOGE("%s while renaming log file %s -> %s", strerror(errno), XPOSEDLOG, XPOSEDLOG_OLD);
-        exit(EXIT_FAILURE);
+        return false;
+    }
+
+    err = rename(XPOSEDLOG_INDEX, XPOSEDLOG_INDEX_OLD);
+    if (err < 0 && errno != ENOENT) {
+        ALOGE("%s while renaming log index %s -> %s", strerror(errno), XPOSEDLOG_INDEX, XPOSEDLOG_INDEX_OLD);
+    }
+
+    CaptureState* capture = (CaptureState*) calloc(1, sizeof(CaptureState));
+    if (capture == NULL) {
+        ALOGE("Could not allocate memory for log capture");
+        return false;
+    }
+
+    umask(0);
+    if (!openLogFiles(&capture->writer, XPOSEDLOG, XPOSEDLOG_INDEX)) {
+        free(capture);
+        return false;
     }
 
     int pipeFds[2];
     if (pipe(pipeFds) < 0) {
         ALOGE("Could not allocate pipe for logcat output: %s", strerror(errno));
-        exit(EXIT_FAILURE);
+        closeLogFiles(&capture->writer);
+        free(capture);
+        return false;
     }
     fcntl(pipeFds[0], F_SETPIPE_SZ, 1048576);
+    fcntl(pipeFds[0], F_SETFD, FD_CLOEXEC);
 
-    if ((pid = fork()) < 0) {
+    if ((capture->logcatPid = fork()) < 0) {
         ALOGE("Fork for logcat execution failed: %s", strerror(errno));
-        exit(EXIT_FAILURE);
-    } else if (pid == 0) {
         close(pipeFds[0]);
+        close(pipeFds[1]);
+        closeLogFiles(&capture->writer);
+        free(capture);
+        return false;
+    } else if (capture->logcatPid == 0) {
         if (dup2(pipeFds[1], STDOUT_FILENO) == -1) {
             ALOGE("Could not redirect stdout: %s", strerror(errno));
             exit(EXIT_FAILURE);
@@ -180,13 +1012,20 @@ void start() {
             exit(EXIT_FAILURE);
         }
         execLogcat();
-    } else {
-        close(pipeFds[1]);
-        runDaemon(pipeFds[0]);
     }
+    close(pipeFds[1]);
+    capture->pipefd = pipeFds[0];
 
-    // Should never reach this point
-    exit(EXIT_FAILURE);
+    startTailServer();
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &captureThread, capture) != 0) {
+        ALOGE("Could not create thread for log capture: %s", strerror(errno));
+        stopCapture(capture);
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
 }
 
 }  // namespace logcat
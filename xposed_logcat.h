@@ -1,16 +1,62 @@
 #ifndef XPOSED_LOGCAT_H_
 #define XPOSED_LOGCAT_H_
 
+#include <stdint.h>
+
 #define XPOSEDLOG            XPOSED_DIR "log/error.log"
 #define XPOSEDLOG_OLD        XPOSEDLOG ".old"
-#define XPOSEDLOG_CONF_ALL   XPOSED_DIR "conf/log_all"
+#define XPOSEDLOG_INDEX      XPOSED_DIR "log/error.idx"
+#define XPOSEDLOG_INDEX_OLD  XPOSEDLOG_INDEX ".old"
+#ifndef XPOSEDLOG_TAIL_SOCKET
+#define XPOSEDLOG_TAIL_SOCKET XPOSED_DIR "log/tail.sock"
+#endif
+#define XPOSEDLOG_CONF_ALL   XPOSED_CONF_DIR "log_all"
+#define XPOSEDLOG_CONF_RATELIMIT XPOSED_CONF_DIR "log_ratelimit"
 #define XPOSEDLOG_MAX_SIZE   5*1024*1024
+#ifndef XPOSEDLOG_BENCH_FILE
+#define XPOSEDLOG_BENCH_FILE "/data/local/tmp/xposed_logbench.log"
+#endif
+#ifndef XPOSEDLOG_LOGCAT
+#define XPOSEDLOG_LOGCAT     "/system/bin/logcat"
+#endif
+
+// An index entry is written after this many lines or seconds, whatever comes first
+#define XPOSEDLOG_INDEX_LINES    256
+#define XPOSEDLOG_INDEX_INTERVAL 10
+
+// The summary for repeated lines is written after this many repetitions or seconds, even if they continue
+#define XPOSEDLOG_REPEAT_LINES    1000
+#define XPOSEDLOG_REPEAT_INTERVAL 10
+
+// Maximum number of different tags tracked for rate limiting
+#define LOG_RATELIMIT_TAGS       32
+
+// New lines are kept in memory for live tail clients, slower clients skip data
+#define LOG_TAIL_RING_SIZE       (64*1024)
+#define LOG_TAIL_MAX_CLIENTS     4
 
 namespace xposed {
 namespace logcat {
 
+    enum LogIndexType {
+        LOG_INDEX_BOOT = 1,          // start of the log for the current boot
+        LOG_INDEX_CHECKPOINT = 2,    // regular checkpoint
+    };
+
+    /** A record in XPOSEDLOG_INDEX, which maps wall clock time to offsets in XPOSEDLOG. */
+    struct LogIndexEntry {
+        int64_t time;       // seconds since the epoch
+        int64_t offset;     // offset of the first line written after that time
+        uint32_t line;      // number of lines before that offset
+        uint32_t type;      // one of LogIndexType
+    };
+
     void printStartupMarker();
-    void start();
+    const char* getStartupMarker();
+    void retainLogAccess();
+    bool startCapture(const char* startupMarker);
+    int64_t findLogOffset(int64_t since);
+    void runBenchmark(int argc, char* const argv[]);
 
 }  // namespace logcat
 }  // namespace xposed
@@ -18,15 +18,24 @@
  *   /include/uapi/linux/input.h (Linux)
  *   Using the Input Subsystem, Linux Journal
  */
+#define LOG_TAG "Xposed"
+
+#include "xposed.h"
 #include "xposed_safemode.h"
 
 #include <cstring>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/input.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #define INITIAL_DELAY 2
@@ -34,13 +43,30 @@
 
 #define DETECTION_PRESSES 5
 
-#define VIBRATOR_CONTROL "/sys/class/timed_output/vibrator/enable"
+// Upper limit for waiting for the background detection, in case the process dies
+#define RESULT_TIMEOUT (INITIAL_DELAY + DETECTION_TIMEOUT + 3)
+
 #define VIBRATION_SHORT 150
 #define VIBRATION_LONG 500
 #define VIBRATION_INTERVAL 200
 
-static const char *DEVICE_PATH = "/dev/input";
-#define MAX_DEVICES 4
+#ifndef SAFEMODE_DEVICE_PATH
+#define SAFEMODE_DEVICE_PATH "/dev/input"
+#endif
+#ifndef SAFEMODE_SYSFS_INPUT_PATH
+#define SAFEMODE_SYSFS_INPUT_PATH "/sys/class/input"
+#endif
+#ifndef SAFEMODE_VIBRATOR_CONTROL
+#define SAFEMODE_VIBRATOR_CONTROL "/sys/class/timed_output/vibrator/enable"
+#endif
+
+// These can be changed for testing, see setSafemodeTestPaths()
+static const char *DEVICE_PATH = SAFEMODE_DEVICE_PATH;
+static const char *SYSFS_INPUT_PATH = SAFEMODE_SYSFS_INPUT_PATH;
+static const char *VIBRATOR_CONTROL = SAFEMODE_VIBRATOR_CONTROL;
+static bool useDeviceCache = true;
+#define MAX_POLL_EVENTS 8
+#define READ_EVENTS 64
 
 #define test_bit(bit, array)    (array[bit/8] & (1<<(bit%8)))
 
@@ -49,112 +75,297 @@ static const int physical_keycodes[] = { KEY_VOLUMEDOWN, KEY_VOLUMEUP, KEY_POWER
 
 
 
-static void vibrate(int count, int duration_ms, int interval_ms) {
+/*
+ * Vibrations are scheduled instead of sleeping between them, so that the
+ * detection loop can keep processing input events in the meantime.
+ */
+struct Vibration {
     int fd;
-    int len;
+    int pending;
+    int duration_ms;
+    int interval_ms;
+    struct timespec next;
+};
+
+static void vibrationPulse(Vibration* vib, int duration_ms) {
+    if (vib->fd < 0)
+        return;
+
     char value[30];
+    int len = sprintf(value, "%d\n", duration_ms);
+    // Vibrate (asynchronously)
+    write(vib->fd, value, len);
+}
 
-    if ((fd = open(VIBRATOR_CONTROL, O_RDWR)) < 0)
-        // Failed to open the control file, ignore it
+static void vibrate(Vibration* vib, int count, int duration_ms, int interval_ms) {
+    if (vib->pending > 0) {
+        // Append to the vibrations which are already scheduled
+        vib->pending += count;
         return;
+    }
+
+    vibrationPulse(vib, duration_ms);
+    vib->pending = count - 1;
+    vib->duration_ms = duration_ms;
+    vib->interval_ms = interval_ms;
+    clock_gettime(CLOCK_MONOTONIC, &vib->next);
+    vib->next.tv_nsec += (long) (duration_ms + interval_ms) * 1000000;
+    vib->next.tv_sec += vib->next.tv_nsec / 1000000000;
+    vib->next.tv_nsec %= 1000000000;
+}
+
+struct KeyDevice {
+    int fd;
+    char name[32];
+    char id[80];  // EVIOCGNAME, to detect when the node name belongs to a different device
+};
+
+/*
+ * Checks the key capabilities which the kernel exports in sysfs, which is much cheaper
+ * than opening the device and querying them with ioctl().
+ * Returns false only if the device definitely doesn't report any of the relevant keys.
+ */
+static bool mightReportKeys(const char* name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s/device/capabilities/key", SYSFS_INPUT_PATH, name);
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL)
+        return true;
+
+    char buf[1024];
+    bool success = fgets(buf, sizeof(buf), fp) != NULL;
+    fclose(fp);
+    if (!success)
+        return true;
+
+    // The bitmask is printed as hex words of the kernel's "long" size, most significant first
+    uint64_t words[64];
+    int wordCount = 0;
+    char* pos = buf;
+    while (wordCount < 64) {
+        char* end;
+        uint64_t word = strtoull(pos, &end, 16);
+        if (end == pos)
+            break;
+        words[wordCount++] = word;
+        pos = end;
+    }
 
-    len = sprintf(value, "%d\n", duration_ms);
-    for (int i = 0; i < count; i++) {
-        if (i != 0)
-            // Pause between the several vibrations
-            usleep((duration_ms + interval_ms) * 1000);
-        // Vibrate (asynchronously)
-        write(fd, value, len);
+    // The word size of the kernel isn't known, so accept the device if either size matches
+    static const int wordBits[] = { 32, 64 };
+    for (size_t i = 0; i < sizeof(physical_keycodes) / sizeof(physical_keycodes[0]); i++) {
+        int code = physical_keycodes[i];
+        for (size_t j = 0; j < sizeof(wordBits) / sizeof(wordBits[0]); j++) {
+            int index = wordCount - 1 - code / wordBits[j];
+            if (index >= 0 && (words[index] >> (code % wordBits[j])) & 1)
+                return true;
+        }
     }
-    close(fd);
+    return false;
 }
 
+/*
+ * Opens an input device if it reports one of the relevant keys.
+ *
+ * Arguments:
+ * - name: the name of the device in DEVICE_PATH
+ * - id: is filled with the name that the device reports, which never contains tabs or newlines
+ * - *pressedKey: is updated with
+ *        the id of the pressed key, if it's the first one that was found being held down
+ *       -1 if more than one key was found being held down
+ * Returns:
+ * - the file handle for the device, or -1 if it doesn't report any relevant keys
+ */
+static int openKeyDevice(const char* name, char* id, size_t idSize, int* pressedKey) {
+    char devname[PATH_MAX];
+    snprintf(devname, sizeof(devname), "%s/%s", DEVICE_PATH, name);
+    int fd = open(devname, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        // Skip files that could not be opened
+        return -1;
+
+    // Check if this device reports one of the relevant keys
+    uint8_t keyBitmask[(KEY_MAX + 1) / 8];
+    memset(keyBitmask, 0, sizeof(keyBitmask));
+    ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keyBitmask)), keyBitmask);
+    bool reportsKeys = false;
+    for (size_t i = 0; i < sizeof(physical_keycodes) / sizeof(physical_keycodes[0]); i++) {
+        if (test_bit(physical_keycodes[i], keyBitmask)) {
+            reportsKeys = true;
+            break;
+        }
+    }
+    if (!reportsKeys) {
+        // This device doesn't report any of the relevant keys
+        close(fd);
+        return -1;
+    }
+
+    memset(id, 0, idSize);
+    if (ioctl(fd, EVIOCGNAME(idSize - 1), id) < 0)
+        id[0] = '\0';
+    for (char* c = id; *c; c++) {
+        if (*c == '\t' || *c == '\n')
+            *c = ' ';
+    }
+
+    // Check if one of the keys is currently pressed on this device, to report it to the caller
+    memset(keyBitmask, 0, sizeof(keyBitmask));
+    ioctl(fd, EVIOCGKEY(sizeof(keyBitmask)), keyBitmask);
+    for (size_t i = 0; i < sizeof(physical_keycodes) / sizeof(physical_keycodes[0]) && *pressedKey >= 0; i++) {
+        if (test_bit(physical_keycodes[i], keyBitmask)) {
+            // One of the relevant keys was detected as held down
+            // We'll report it to be pressed, but only if there isn't more than one key being pressed
+            if (*pressedKey == 0) {
+                // No key was being pressed, this one will be reported
+                *pressedKey = physical_keycodes[i];
+            } else {
+                // Another key was already found to be pressed, report multiple keys to the caller
+                *pressedKey = -1;
+            }
+        }
+    }
+
+    return fd;
+}
+
+static bool addKeyDevice(KeyDevice** devices, int* count, int* capacity, const char* name, const char* id, int fd) {
+    if (*count == *capacity) {
+        int newCapacity = (*capacity > 0) ? *capacity * 2 : 4;
+        KeyDevice* newDevices = (KeyDevice*) realloc(*devices, newCapacity * sizeof(KeyDevice));
+        if (newDevices == NULL)
+            return false;
+        *devices = newDevices;
+        *capacity = newCapacity;
+    }
+
+    KeyDevice* device = &(*devices)[(*count)++];
+    device->fd = fd;
+    strlcpy(device->name, name, sizeof(device->name));
+    strlcpy(device->id, id, sizeof(device->id));
+    return true;
+}
+
+static void closeKeyDevices(KeyDevice* devices, int count) {
+    for (int i = 0; i < count; i++)
+        close(devices[i].fd);
+    free(devices);
+}
+
+/*
+ * Opens the devices which qualified during the last boot. Each line contains the node name and
+ * the device name, separated by a tab. Node numbers can change, e.g. when devices are probed in
+ * a different order, so the device behind a node must still report the same name.
+ * Returns false if the list isn't available or doesn't match the current devices anymore.
+ */
+static bool openCachedKeyDevices(KeyDevice** devices, int* count, int* pressedKey) {
+    FILE* fp = fopen(XPOSED_SAFEMODE_DEVICES, "r");
+    if (fp == NULL)
+        return false;
+
+    int capacity = 0;
+    char line[sizeof(KeyDevice::name) + sizeof(KeyDevice::id) + 2];
+    char id[sizeof(KeyDevice::id)];
+    bool success = true;
+    while (success && fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        char* cachedId = strchr(line, '\t');
+        if (cachedId == NULL || cachedId - line >= (ptrdiff_t) sizeof(KeyDevice::name)) {
+            success = false;
+            break;
+        }
+        *cachedId++ = '\0';
+
+        int fd = openKeyDevice(line, id, sizeof(id), pressedKey);
+        if (fd >= 0 && strcmp(id, cachedId) != 0) {
+            ALOGI("Input device %s is now \"%s\" instead of \"%s\", searching all devices", line, id, cachedId);
+            close(fd);
+            fd = -1;
+        }
+        success = fd >= 0 && addKeyDevice(devices, count, &capacity, line, id, fd);
+    }
+    fclose(fp);
+
+    if (!success || *count == 0) {
+        closeKeyDevices(*devices, *count);
+        *devices = NULL;
+        *count = 0;
+        *pressedKey = 0;
+        return false;
+    }
+    return true;
+}
+
+static void writeCachedKeyDevices(const KeyDevice* devices, int count) {
+    FILE* fp = fopen(XPOSED_SAFEMODE_DEVICES ".tmp", "w");
+    if (fp == NULL)
+        return;
+
+    for (int i = 0; i < count; i++)
+        fprintf(fp, "%s\t%s\n", devices[i].name, devices[i].id);
+    bool success = fclose(fp) == 0;
+
+    if (!success || rename(XPOSED_SAFEMODE_DEVICES ".tmp", XPOSED_SAFEMODE_DEVICES) != 0)
+        unlink(XPOSED_SAFEMODE_DEVICES ".tmp");
+}
 
 /*
  * Enumerates the existing input devices and opens handles for the ones that
- * report the relevant keys.
+ * report the relevant keys. The devices which qualified during the last boot
+ * are tried first, otherwise only devices with matching capabilities in sysfs
+ * are opened.
  *
  * Arguments:
- * - *fds: is filled on output with the file handles for the opened devices
- * - max_fds: maximum available entries in the fds array
+ * - *devices: is filled on output with the opened devices, to be freed with closeKeyDevices()
  * - *pressedKey: is filled on output with
  *        0 if no key was found being held down at this instant
  *       -1 if more than one key was found being held down
  *       id of the pressed key, if only a single one was being held down
  * Returns:
- * - the number of opened device handles, filled in the *fds output parameter
+ * - the number of opened devices
  * - 0 if no devices were opened
  */
-static int openKeyDevices(int *fds, int max_fds, int *pressedKey) {
-    char devname[PATH_MAX];
-    char *filename;
+static int openKeyDevices(KeyDevice** devices, int *pressedKey) {
+    int count = 0;
+    int capacity = 0;
     DIR *dir;
     struct dirent *de;
 
-    int count = 0;
+    *devices = NULL;
     // No key was detected as pressed, for the moment
     *pressedKey = 0;
 
+    if (useDeviceCache && openCachedKeyDevices(devices, &count, pressedKey))
+        return count;
+
     dir = opendir(DEVICE_PATH);
     if(dir == NULL)
         return 0;
 
-    strcpy(devname, DEVICE_PATH);
-    filename = devname + strlen(devname);
-    *filename++ = '/';
-    while (count < max_fds && (de = readdir(dir))) {
+    while ((de = readdir(dir))) {
         // Skip '.' and '..'
         if(de->d_name[0] == '.' &&
            (de->d_name[1] == '\0' ||
             (de->d_name[1] == '.' && de->d_name[2] == '\0')))
             continue;
 
-        strcpy(filename, de->d_name);
-        int fd = open(devname, O_RDWR | O_CLOEXEC);
-        if(fd < 0)
-            // Skip files that could not be opened
+        if (strlen(de->d_name) >= sizeof(KeyDevice::name) || !mightReportKeys(de->d_name))
             continue;
 
-        // Check if this device reports one of the relevant keys
-        uint8_t keyBitmask[(KEY_MAX + 1) / 8];
-        memset(keyBitmask, 0, sizeof(keyBitmask));
-        ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keyBitmask)), keyBitmask);
-        bool reportsKeys = false;
-        for (size_t i = 0; i < sizeof(physical_keycodes) / sizeof(physical_keycodes[0]); i++) {
-            if (test_bit(physical_keycodes[i], keyBitmask)) {
-                reportsKeys = true;
-                break;
-            }
-        }
-        if (!reportsKeys) {
-            // This device doesn't report any of the relevant keys
-            // Skip to the next one
-            close(fd);
+        char id[sizeof(KeyDevice::id)];
+        int fd = openKeyDevice(de->d_name, id, sizeof(id), pressedKey);
+        if (fd < 0)
             continue;
-        }
 
-        fds[count++] = fd;
-
-        // Check if one of the keys is currently pressed on this device, to report it to the caller
-        memset(keyBitmask, 0, sizeof(keyBitmask));
-        ioctl(fd, EVIOCGKEY(sizeof(keyBitmask)), keyBitmask);
-        for (size_t i = 0; i < sizeof(physical_keycodes) / sizeof(physical_keycodes[0]); i++) {
-            if (test_bit(physical_keycodes[i], keyBitmask)) {
-                // One of the relevant keys was detected as held down
-                // We'll report it to be pressed, but only if there isn't more than one key being pressed
-                if (*pressedKey == 0) {
-                    // No key was being pressed, this one will be reported
-                    *pressedKey = physical_keycodes[i];
-                } else {
-                    // Another key was already found to be pressed, report multiple keys to the caller
-                    *pressedKey = -1;
-                    break;
-                }
-            }
+        if (!addKeyDevice(devices, &count, &capacity, de->d_name, id, fd)) {
+            close(fd);
+            break;
         }
     }
 
     closedir(dir);
+    if (useDeviceCache)
+        writeCachedKeyDevices(*devices, count);
     return count;
 }
 
@@ -162,30 +373,163 @@ static int openKeyDevices(int *fds, int max_fds, int *pressedKey) {
 /*
  * Computes the remaining time, in ms, from the current time to the supplied expiration moment
  */
-int getRemainingTime(struct timespec expiration) {
+static int getRemainingTime(struct timespec expiration) {
     struct timespec now;
     clock_gettime(CLOCK_MONOTONIC, &now);
     if (now.tv_sec > expiration.tv_sec)
         return 0;
-    else
-        return (expiration.tv_sec - now.tv_sec) * 1000 + (expiration.tv_nsec - now.tv_nsec) / 1000000;
+    int remaining = (expiration.tv_sec - now.tv_sec) * 1000 + (expiration.tv_nsec - now.tv_nsec) / 1000000;
+    return (remaining > 0) ? remaining : 0;
+}
+
+
+/*
+ * Events are read in batches, the remaining ones are kept for the next call.
+ */
+struct EventQueue {
+    struct input_event events[READ_EVENTS];
+    int pos;
+    int count;
+};
+
+/*
+ * Returns the code of the next relevant key press in the queue, or 0 if there is none.
+ */
+static int nextKeyPress(EventQueue* queue) {
+    while (queue->pos < queue->count) {
+        const struct input_event& evt = queue->events[queue->pos++];
+        if (evt.type != EV_KEY)
+            // Only consider key events
+            continue;
+        if (evt.value != 1)
+            // Ignore key releases, we're monitoring presses
+            continue;
+
+        for (size_t j = 0; j < sizeof(physical_keycodes) / sizeof(physical_keycodes[0]); j++) {
+            if (evt.code == physical_keycodes[j]) {
+                // No need to check for duplicate keys, as the events are reported sequentially
+                // and multiple presses can't be reported at once
+                return evt.code;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Waits for the next press of one of the relevant keys, while performing the scheduled vibrations.
+ *
+ * Returns:
+ * - the code of the pressed key
+ * - 0 if the expiration moment was reached
+ * - -1 in case of errors
+ */
+static int waitForKeyPress(int efd, struct timespec expiration, Vibration* vib, EventQueue* queue) {
+    struct epoll_event eventPollItems[MAX_POLL_EVENTS];
+    int timeout_ms;
+    int key = nextKeyPress(queue);
+    if (key != 0)
+        return key;
+
+    while ((timeout_ms = getRemainingTime(expiration)) > 0) {
+        if (vib->pending > 0) {
+            int vibration_ms = getRemainingTime(vib->next);
+            if (vibration_ms == 0) {
+                vibrationPulse(vib, vib->duration_ms);
+                vib->pending--;
+                vib->next.tv_nsec += (long) (vib->duration_ms + vib->interval_ms) * 1000000;
+                vib->next.tv_sec += vib->next.tv_nsec / 1000000000;
+                vib->next.tv_nsec %= 1000000000;
+                continue;
+            } else if (vibration_ms < timeout_ms) {
+                timeout_ms = vibration_ms;
+            }
+        }
+
+        // Wait for next input event in one of the opened devices
+        int pollResult = epoll_wait(efd, eventPollItems, MAX_POLL_EVENTS, timeout_ms);
+        if (pollResult < 0) {
+            if (errno == EINTR)
+                continue;
+            // Failed to wait for event, abort
+            return -1;
+        }
+
+        // Loop through the opened devices where a new event is available
+        // Devices which aren't read here stay ready for the next epoll_wait()
+        for (int i = 0; i < pollResult; i++) {
+            ssize_t readSize = read(eventPollItems[i].data.fd, queue->events, sizeof(queue->events));
+            queue->pos = 0;
+            queue->count = (readSize > 0) ? readSize / sizeof(struct input_event) : 0;
+
+            key = nextKeyPress(queue);
+            if (key != 0)
+                return key;
+        }
+    }
+    return 0;
 }
 
 
 
 namespace xposed {
 
+// Progress of the background detection, so Zygote knows whether it's worth waiting for it
+enum DetectionPhase {
+    PHASE_OPENING,  // the input devices are being opened
+    PHASE_WAITING,  // no key is held, waiting for the first press
+    PHASE_SEQUENCE, // a key was held or pressed, counting the presses
+};
+
+struct SafemodeResult {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int state;
+    int phase;
+};
+
+static SafemodeResult* backgroundResult = NULL;
+// Only set in the detection process
+static SafemodeResult* detectionResult = NULL;
+
+/*
+ * Publishes the progress of the background detection.
+ * Returns false if Zygote has already decided on the result, then the detection must stop.
+ */
+static bool enterDetectionPhase(int phase) {
+    SafemodeResult* result = detectionResult;
+    if (result == NULL)
+        return true;
+
+    pthread_mutex_lock(&result->mutex);
+    bool pending = result->state == SAFEMODE_PENDING;
+    if (pending) {
+        result->phase = phase;
+        pthread_cond_broadcast(&result->cond);
+    }
+    pthread_mutex_unlock(&result->mutex);
+    return pending;
+}
+
 bool detectSafemodeTrigger(bool skipInitialDelay) {
 
     int efd = -1;
-    int fds[MAX_DEVICES];
+    KeyDevice* devices = NULL;
     int deviceCount = 0;
     int pressedKey = 0;
     int triggerPresses = 0;
     bool result = false;
+    struct timespec expiration;
+    EventQueue queue;
+    queue.pos = queue.count = 0;
+    Vibration vib;
+    memset(&vib, 0, sizeof(vib));
+    // Failing to open the control file is ignored
+    vib.fd = open(VIBRATOR_CONTROL, O_RDWR | O_CLOEXEC);
 
     // Open input devices that report one of the relevant physical keys
-    deviceCount = openKeyDevices(fds, sizeof(fds) / sizeof(fds[0]), &pressedKey);
+    deviceCount = openKeyDevices(&devices, &pressedKey);
     if (deviceCount == 0)
         // No input devices found, abort detection
         goto leave;
@@ -200,69 +544,42 @@ bool detectSafemodeTrigger(bool skipInitialDelay) {
         // Immediately report a negative detection, with no further delays
         goto leave;
 
+    if (!enterDetectionPhase(pressedKey == 0 ? PHASE_WAITING : PHASE_SEQUENCE))
+        goto leave;
+
     // Prepare waiting mechanism for received events in all devices
     if ((efd = epoll_create(deviceCount)) < 0)
         // Failed to create the epoll handle, abort
         goto leave;
 
     // Register each device descriptor in the epoll handle
-    struct epoll_event eventPollItems[MAX_DEVICES];
     for (int i = 0; i < deviceCount; i++) {
-        memset(&eventPollItems[i], 0, sizeof(eventPollItems[i]));
-        eventPollItems[i].events = EPOLLIN;
-        eventPollItems[i].data.fd = fds[i];
-        if (epoll_ctl(efd, EPOLL_CTL_ADD, fds[i], &eventPollItems[i]))
+        struct epoll_event eventPollItem;
+        memset(&eventPollItem, 0, sizeof(eventPollItem));
+        eventPollItem.events = EPOLLIN;
+        eventPollItem.data.fd = devices[i].fd;
+        if (epoll_ctl(efd, EPOLL_CTL_ADD, devices[i].fd, &eventPollItem))
             // Failed to add device descriptor to the epoll handle, abort
             goto leave;
     }
 
-    int timeout_ms;
-    struct timespec expiration;
-    clock_gettime(CLOCK_MONOTONIC, &expiration);
-    expiration.tv_sec += INITIAL_DELAY;
-
     // Wait up to INITIAL_DELAY seconds for an initial keypress, it no key was initially down
-    while (pressedKey == 0 && (timeout_ms = getRemainingTime(expiration)) > 0) {
-        // Wait for next input event in one of the opened devices
-        int pollResult = epoll_wait(efd, eventPollItems, sizeof(eventPollItems) / sizeof(eventPollItems[0]), timeout_ms);
-        if (pollResult < 0)
-            // Failed to wait for event, abort
-            goto leave;
-
-        // Loop through the opened devices where a new event is available
-        for (int i = 0; i < pollResult; i++) {
-            struct input_event evt;
-            int32_t readSize = read(eventPollItems[i].data.fd, &evt, sizeof(evt));
-            if (readSize != sizeof(evt))
-                // Invalid size read, ignore
-                continue;
-
-            if (evt.type != EV_KEY)
-                // Only consider key events
-                continue;
-            if (evt.value != 1)
-                // Ignore key releases, we're monitoring presses
-                continue;
-
-            for (size_t j = 0; j < sizeof(physical_keycodes) / sizeof(physical_keycodes[0]); j++) {
-                if (evt.code == physical_keycodes[j]) {
-                    // One of the keys was pressed, end the initial detection
-                    // No need to check for duplicate keys, as the events are reported sequentially
-                    // and multiple presses can't be reported at once
-                    pressedKey = evt.code;
-                    break;
-                }
-            }
-        }
+    if (pressedKey == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &expiration);
+        expiration.tv_sec += INITIAL_DELAY;
+        pressedKey = waitForKeyPress(efd, expiration, &vib, &queue);
     }
-    if (pressedKey == 0)
+    if (pressedKey <= 0)
         // No key was pressed during the initial delay or upfront, so the detection has failed
         goto leave;
 
+    if (!enterDetectionPhase(PHASE_SEQUENCE))
+        // Zygote didn't wait for the first press anymore
+        goto leave;
+
     // Notify the user that the safemode sequence has been started and we're waiting for
     // the remaining key presses
-    vibrate(2, VIBRATION_SHORT, VIBRATION_INTERVAL);
-
+    vibrate(&vib, 2, VIBRATION_SHORT, VIBRATION_INTERVAL);
 
     // Detection will wait at most DETECTION_TIMEOUT seconds
     clock_gettime(CLOCK_MONOTONIC, &expiration);
@@ -273,62 +590,152 @@ bool detectSafemodeTrigger(bool skipInitialDelay) {
 
     // Loop waiting for the same key to be pressed the appropriate number of times, a different key to
     // be pressed, or the timeout to be reached
-    while (triggerPresses < DETECTION_PRESSES && (timeout_ms = getRemainingTime(expiration)) > 0) {
-        // Wait for next input event
-        int pollResult = epoll_wait(efd, eventPollItems, sizeof(eventPollItems) / sizeof(eventPollItems[0]), timeout_ms);
-        if (pollResult < 0)
-            // Failed to wait for event, abort
+    while (triggerPresses < DETECTION_PRESSES) {
+        int key = waitForKeyPress(efd, expiration, &vib, &queue);
+        if (key != pressedKey)
+            // Timeout, error or a key was pressed other than the initial one
+            // Abort the detection and avoid further delays
             goto leave;
 
-        // Loop through the opened devices where a new event is available
-        for (int i = 0; i < pollResult; i++) {
-            struct input_event evt;
-            int32_t readSize = read(eventPollItems[i].data.fd, &evt, sizeof(evt));
-            if (readSize != sizeof(evt))
-                // Invalid size read, ignore
-                continue;
-
-            if (evt.type != EV_KEY)
-                // Only consider key events
-                continue;
-            if (evt.value != 1)
-                // Ignore key releases, we're monitoring presses
-                continue;
-
-            for (size_t j = 0; j < sizeof(physical_keycodes) / sizeof(physical_keycodes[0]); j++) {
-                if (evt.code == physical_keycodes[j]) {
-                    if (pressedKey == evt.code) {
-                        // The same key was pressed again, increment the counter and notify the user
-                        triggerPresses++;
-                        // The final key press will be confirmed with a long vibration later
-                        if (triggerPresses < DETECTION_PRESSES)
-                            vibrate(1, VIBRATION_SHORT, 0);
-                    } else {
-                        // A key was pressed other than the initial one
-                        // Abort the detection and avoid further delays
-                        goto leave;
-                    }
-                    break;
-                }
-            }
-        }
+        // The same key was pressed again, increment the counter and notify the user
+        triggerPresses++;
+        // The final key press will be confirmed with a long vibration later
+        if (triggerPresses < DETECTION_PRESSES)
+            vibrate(&vib, 1, VIBRATION_SHORT, 0);
     }
 
-    // Was safemode successfully triggered?
-    if (triggerPresses >= DETECTION_PRESSES) {
-        vibrate(1, VIBRATION_LONG, 0);
-        result = true;
-    }
+    // Safemode was successfully triggered
+    vibrationPulse(&vib, VIBRATION_LONG);
+    result = true;
 
 leave:
     if (efd >= 0)
         close(efd);
-    for (int i = 0; i < deviceCount; i++)
-        close(fds[i]);
+    closeKeyDevices(devices, deviceCount);
+    if (vib.fd >= 0)
+        close(vib.fd);
 
     return result;
 
 }
 
+/*
+ * Uses different input devices (e.g. a directory with links to uinput devices) and vibrator
+ * control file, so that the detection can be tested with scripted events.
+ */
+void setSafemodeTestPaths(const char* devicePath, const char* vibratorPath) {
+    if (devicePath != NULL)
+        DEVICE_PATH = devicePath;
+    if (vibratorPath != NULL)
+        VIBRATOR_CONTROL = vibratorPath;
+    useDeviceCache = false;
+}
+
+/*
+ * Runs the detection in a separate process, so that Zygote can continue to start the VM meanwhile.
+ * A process is used instead of a thread because Zygote must stay single-threaded for forking.
+ * It is forked twice, so init reaps it even if Zygote never asks for the result.
+ */
+bool startSafemodeDetection(bool skipInitialDelay) {
+    SafemodeResult* result = (SafemodeResult*) mmap(NULL, sizeof(SafemodeResult), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (result == MAP_FAILED) {
+        ALOGE("Could not allocate memory for safemode detection: %s", strerror(errno));
+        return false;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&result->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&result->cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    result->state = SAFEMODE_PENDING;
+    result->phase = PHASE_OPENING;
+
+    pid_t pid;
+    if ((pid = fork()) < 0) {
+        ALOGE("Fork for safemode detection failed: %s", strerror(errno));
+        munmap(result, sizeof(SafemodeResult));
+        return false;
+    } else if (pid == 0) {
+        if ((pid = fork()) != 0) {
+            if (pid < 0)
+                ALOGE("Fork for safemode detection failed: %s", strerror(errno));
+            _exit(pid < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+
+        setProcessName("xposed_safemode");
+        detectionResult = result;
+        bool triggered = detectSafemodeTrigger(skipInitialDelay);
+
+        pthread_mutex_lock(&result->mutex);
+        if (result->state == SAFEMODE_PENDING) {
+            setSafemodeResult(triggered);
+            result->state = triggered ? SAFEMODE_TRIGGERED : SAFEMODE_NOT_TRIGGERED;
+            pthread_cond_broadcast(&result->cond);
+        }
+        pthread_mutex_unlock(&result->mutex);
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status;
+    if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        munmap(result, sizeof(SafemodeResult));
+        return false;
+    }
+
+    // Neither system_server nor the apps that Zygote forks later need the result
+    madvise(result, sizeof(SafemodeResult), MADV_DONTFORK);
+    backgroundResult = result;
+    return true;
+}
+
+/**
+ * Wait for the result of the background detection, if it was started. If no key is held and none
+ * has been pressed until now, the rest of the initial delay isn't waited for.
+ */
+bool waitForSafemodeResult() {
+    SafemodeResult* result = backgroundResult;
+    if (result == NULL)
+        return false;
+    backgroundResult = NULL;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += RESULT_TIMEOUT;
+    int rc = 0;
+    pthread_mutex_lock(&result->mutex);
+    while (result->state == SAFEMODE_PENDING && rc == 0) {
+        if (result->phase == PHASE_WAITING) {
+            // The detection process stops when it sees that the result was decided
+            setSafemodeResult(false);
+            result->state = SAFEMODE_NOT_TRIGGERED;
+            break;
+        }
+        rc = pthread_cond_timedwait(&result->cond, &result->mutex, &ts);
+    }
+    int state = result->state;
+    pthread_mutex_unlock(&result->mutex);
+    munmap(result, sizeof(SafemodeResult));
+
+    if (state == SAFEMODE_PENDING)
+        ALOGE("Timeout while waiting for safemode detection");
+    return state == SAFEMODE_TRIGGERED;
+}
+
+/** Drop the result of the background detection when Xposed won't be loaded anyway. */
+void releaseSafemodeDetection() {
+    if (backgroundResult == NULL)
+        return;
+    munmap(backgroundResult, sizeof(SafemodeResult));
+    backgroundResult = NULL;
 }
 
+}
@@ -3,7 +3,17 @@
 
 namespace xposed {
 
+enum SafemodeState {
+    SAFEMODE_PENDING,
+    SAFEMODE_NOT_TRIGGERED,
+    SAFEMODE_TRIGGERED,
+};
+
 bool detectSafemodeTrigger(bool skipInitialDelay);
+void setSafemodeTestPaths(const char* devicePath, const char* vibratorPath);
+bool startSafemodeDetection(bool skipInitialDelay);
+bool waitForSafemodeResult();
+void releaseSafemodeDetection();
 
 }
 
@@ -5,7 +5,9 @@
 #define LOG_TAG "Xposed"
 
 #include "xposed.h"
+#include "xposed_logcat.h"
 #include "xposed_service.h"
+#include "xposed_stats.h"
 
 #include <binder/BpBinder.h>
 #include <binder/IInterface.h>
@@ -13,6 +15,7 @@
 #include <binder/IServiceManager.h>
 #include <binder/Parcel.h>
 #include <binder/ProcessState.h>
+#include <cutils/ashmem.h>
 #include <errno.h>
 #include <fcntl.h>
 #define __STDC_FORMAT_MACROS
@@ -20,6 +23,7 @@
 #include <sys/mman.h>
 
 #define UID_SYSTEM 1000
+#define READ_LOG_MAX_LENGTH (256*1024)
 
 using namespace android;
 
@@ -51,6 +55,7 @@ enum Action {
     OP_ACCESS_FILE,
     OP_STAT_FILE,
     OP_READ_FILE,
+    OP_READ_CONFIG,
 };
 
 struct AccessFileData {
@@ -81,6 +86,11 @@ struct ReadFileData {
     char content[32*1024];
 };
 
+struct ReadConfigData {
+    // out
+    XposedConfig config;
+};
+
 struct MemBasedState {
     pthread_mutex_t workerMutex;
     pthread_cond_t workerCond;
@@ -91,10 +101,12 @@ struct MemBasedState {
         AccessFileData accessFile;
         StatFileData statFile;
         ReadFileData readFile;
+        ReadConfigData readConfig;
     } data;
 };
 
 MemBasedState* shared = NULL;
+int sharedFd = -1;
 pid_t zygotePid = 0;
 bool canAlwaysAccessService = false;
 
@@ -115,9 +127,19 @@ inline static void initSharedCond(pthread_cond_t* cond) {
 }
 
 static bool init() {
-    shared = (MemBasedState*) mmap(NULL, sizeof(MemBasedState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (shared == MAP_FAILED) {
+    // The memory is passed to the service process as file descriptor
+    sharedFd = ashmem_create_region("xposed_zygote_service", sizeof(MemBasedState));
+    if (sharedFd < 0) {
         ALOGE("Could not allocate memory for Zygote service: %s", strerror(errno));
+        return false;
+    }
+    fcntl(sharedFd, F_SETFD, FD_CLOEXEC);
+
+    shared = (MemBasedState*) mmap(NULL, sizeof(MemBasedState), PROT_READ | PROT_WRITE, MAP_SHARED, sharedFd, 0);
+    if (shared == MAP_FAILED) {
+        ALOGE("Could not map memory for Zygote service: %s", strerror(errno));
+        close(sharedFd);
+        sharedFd = -1;
         shared = NULL;
         return false;
     }
@@ -133,6 +155,26 @@ static bool init() {
     return true;
 }
 
+/** Map the memory which was passed from Zygote, in the service process. */
+static bool attach(int fd) {
+    shared = (MemBasedState*) mmap(NULL, sizeof(MemBasedState), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        ALOGE("Could not map memory for Zygote service: %s", strerror(errno));
+        shared = NULL;
+        return false;
+    }
+    return true;
+}
+
+/** Zygote doesn't need the file descriptor anymore once the service process has been started. */
+static void closeSharedFd() {
+    if (sharedFd >= 0) {
+        close(sharedFd);
+        sharedFd = -1;
+    }
+}
+
 void restrictMemoryInheritance() {
     madvise(shared, sizeof(MemBasedState), MADV_DONTFORK);
     canAlwaysAccessService = false;
@@ -158,6 +200,8 @@ void* looper(void* unused __attribute__((unused))) {
             pthread_cond_wait(&shared->workerCond, &shared->workerMutex);
         }
 
+        int64_t start = monotonicNs();
+        uint64_t bytes = 0;
         switch (shared->action) {
             case OP_ACCESS_FILE: {
                 struct AccessFileData* data = &shared->data.accessFile;
@@ -199,12 +243,17 @@ void* looper(void* unused __attribute__((unused))) {
                 }
 
                 data->bytesRead = fread(data->content, 1, sizeof(data->content), f);
+                bytes = data->bytesRead;
                 shared->error = ferror(f);
                 data->eof = feof(f);
 
                 fclose(f);
             } break;
 
+            case OP_READ_CONFIG: {
+                xposed::readConfig(&shared->data.readConfig.config);
+            } break;
+
             case OP_NONE: {
                 ALOGE("No-op call to membased service");
                 break;
@@ -216,6 +265,11 @@ void* looper(void* unused __attribute__((unused))) {
             }
         }
 
+        if (shared->action >= OP_ACCESS_FILE && shared->action <= OP_READ_CONFIG) {
+            stats::StatsOp op = (stats::StatsOp) (stats::STATS_MEMBASED_ACCESS_FILE + shared->action - OP_ACCESS_FILE);
+            stats::recordOp(op, start, bytes, shared->error != 0);
+        }
+
         shared->state = STATE_SERVER_RESPONSE;
         pthread_cond_broadcast(&shared->workerCond);
     }
@@ -370,6 +424,21 @@ char* readFile(const char* path, int* bytesRead) {
     return result;
 }
 
+int readConfig(XposedConfig* config) {
+    if (!isServiceAccessible())
+        return -1;
+
+    waitForIdle();
+
+    callService(OP_READ_CONFIG);
+
+    memcpy(config, &shared->data.readConfig.config, sizeof(XposedConfig));
+
+    makeIdle();
+    errno = shared->error;
+    return shared->error ? -1 : 0;
+}
+
 }  // namespace membased
 
 
@@ -402,6 +471,15 @@ class IXposedService: public IInterface {
                                   uint8_t** buffer,
                                   int32_t* bytesRead,
                                   String16* errormsg) const = 0;
+        virtual status_t readLog(int64_t since,
+                                 int64_t logId,
+                                 int64_t offset,
+                                 int32_t length,
+                                 int64_t* nextLogId,
+                                 int64_t* nextOffset,
+                                 uint8_t** buffer,
+                                 int32_t* bytesRead,
+                                 String16* errormsg) const = 0;
 
         enum {
             TEST_TRANSACTION = IBinder::FIRST_CALL_TRANSACTION,
@@ -409,6 +487,7 @@ class IXposedService: public IInterface {
             ACCESS_FILE_TRANSACTION,
             STAT_FILE_TRANSACTION,
             READ_FILE_TRANSACTION,
+            READ_LOG_TRANSACTION,
         };
 };
 
@@ -509,6 +588,40 @@ class BpXposedService: public BpInterface<IXposedService> {
             errno = err;
             return (errno == 0) ? 0 : -1;
         }
+
+        virtual status_t readLog(int64_t since, int64_t logId, int64_t offset, int32_t length,
+                int64_t* nextLogId, int64_t* nextOffset, uint8_t** buffer, int32_t* bytesRead, String16* errormsg) const {
+            Parcel data, reply;
+            data.writeInterfaceToken(IXposedService::getInterfaceDescriptor());
+            data.writeInt64(since);
+            data.writeInt64(logId);
+            data.writeInt64(offset);
+            data.writeInt32(length);
+
+            remote()->transact(READ_LOG_TRANSACTION, data, &reply);
+            if (reply.readExceptionCode() != 0) return -1;
+
+            status_t err = reply.readInt32();
+            const String16& errormsg1(reply.readString16());
+            int64_t nextLogId1 = reply.readInt64();
+            int64_t nextOffset1 = reply.readInt64();
+            int32_t bytesRead1 = reply.readInt32();
+            if (nextLogId != NULL) *nextLogId = nextLogId1;
+            if (nextOffset != NULL) *nextOffset = nextOffset1;
+            if (bytesRead != NULL) *bytesRead = bytesRead1;
+            if (errormsg) *errormsg = errormsg1;
+
+            if (bytesRead1 > 0 && bytesRead1 <= (int32_t)reply.dataAvail()) {
+                *buffer = (uint8_t*) malloc(bytesRead1 + 1);
+                (*buffer)[bytesRead1] = 0;
+                reply.read(*buffer, bytesRead1);
+            } else {
+                *buffer = NULL;
+            }
+
+            errno = err;
+            return (errno == 0) ? 0 : -1;
+        }
 };
 
 IMPLEMENT_META_INTERFACE(XposedService, "de.robv.android.xposed.IXposedService");
@@ -516,6 +629,7 @@ IMPLEMENT_META_INTERFACE(XposedService, "de.robv.android.xposed.IXposedService")
 status_t BnXposedService::onTransact(uint32_t code, const Parcel& data, Parcel* reply, uint32_t flags)  {
     switch (code) {
         case TEST_TRANSACTION: {
+            stats::ScopedOp op(stats::STATS_BINDER_TEST);
             CHECK_INTERFACE(IXposedService, data, reply);
             reply->writeNoException();
             reply->writeInt32(test());
@@ -523,6 +637,7 @@ status_t BnXposedService::onTransact(uint32_t code, const Parcel& data, Parcel*
         } break;
 
         case ADD_SERVICE_TRANSACTION: {
+            stats::ScopedOp op(stats::STATS_BINDER_ADD_SERVICE);
             CHECK_INTERFACE(IXposedService, data, reply);
             String16 which = data.readString16();
             sp<IBinder> b = data.readStrongBinder();
@@ -532,22 +647,26 @@ status_t BnXposedService::onTransact(uint32_t code, const Parcel& data, Parcel*
         } break;
 
         case ACCESS_FILE_TRANSACTION: {
+            stats::ScopedOp op(stats::STATS_BINDER_ACCESS_FILE);
             CHECK_INTERFACE(IXposedService, data, reply);
             String16 filename = data.readString16();
             int32_t mode = data.readInt32();
             status_t result = accessFile(filename, mode);
             int err = errno;
+            op.error = (result != 0);
             reply->writeNoException();
             reply->writeInt32(result == 0 ? 0 : err);
             return NO_ERROR;
         } break;
 
         case STAT_FILE_TRANSACTION: {
+            stats::ScopedOp op(stats::STATS_BINDER_STAT_FILE);
             CHECK_INTERFACE(IXposedService, data, reply);
             String16 filename = data.readString16();
             int64_t size, time;
             status_t result = statFile(filename, &size, &time);
             int err = errno;
+            op.error = (result != 0);
             reply->writeNoException();
             if (result == 0) {
                 reply->writeInt32(0);
@@ -560,6 +679,7 @@ status_t BnXposedService::onTransact(uint32_t code, const Parcel& data, Parcel*
         } break;
 
         case READ_FILE_TRANSACTION: {
+            stats::ScopedOp op(stats::STATS_BINDER_READ_FILE);
             CHECK_INTERFACE(IXposedService, data, reply);
             String16 filename = data.readString16();
             int32_t offset = data.readInt32();
@@ -571,6 +691,8 @@ status_t BnXposedService::onTransact(uint32_t code, const Parcel& data, Parcel*
             String16 errormsg;
 
             status_t err = readFile(filename, offset, length, &size, &mtime, &buffer, &bytesRead, &errormsg);
+            op.error = (err != 0);
+            op.bytes = (bytesRead > 0) ? bytesRead : 0;
 
             reply->writeNoException();
             reply->writeInt32(err);
@@ -587,6 +709,38 @@ status_t BnXposedService::onTransact(uint32_t code, const Parcel& data, Parcel*
             return NO_ERROR;
         } break;
 
+        case READ_LOG_TRANSACTION: {
+            stats::ScopedOp op(stats::STATS_BINDER_READ_LOG);
+            CHECK_INTERFACE(IXposedService, data, reply);
+            int64_t since = data.readInt64();
+            int64_t logId = data.readInt64();
+            int64_t offset = data.readInt64();
+            int32_t length = data.readInt32();
+            int64_t nextLogId = logId;
+            int64_t nextOffset = offset;
+            uint8_t* buffer = NULL;
+            int32_t bytesRead = -1;
+            String16 errormsg;
+
+            status_t err = readLog(since, logId, offset, length, &nextLogId, &nextOffset, &buffer, &bytesRead, &errormsg);
+            op.error = (err != 0);
+            op.bytes = (bytesRead > 0) ? bytesRead : 0;
+
+            reply->writeNoException();
+            reply->writeInt32(err);
+            reply->writeString16(errormsg);
+            reply->writeInt64(nextLogId);
+            reply->writeInt64(nextOffset);
+            if (bytesRead > 0) {
+                reply->writeInt32(bytesRead);
+                reply->write(buffer, bytesRead);
+                free(buffer);
+            } else {
+                reply->writeInt32(bytesRead); // empty array (0) or null (-1)
+            }
+            return NO_ERROR;
+        } break;
+
         default:
             return BBinder::onTransact(code, data, reply, flags);
     }
@@ -613,6 +767,15 @@ class XposedService : public BnXposedService {
                                   uint8_t** buffer,
                                   int32_t* bytesRead,
                                   String16* errormsg) const;
+        virtual status_t readLog(int64_t since,
+                                 int64_t logId,
+                                 int64_t offset,
+                                 int32_t length,
+                                 int64_t* nextLogId,
+                                 int64_t* nextOffset,
+                                 uint8_t** buffer,
+                                 int32_t* bytesRead,
+                                 String16* errormsg) const;
 
     private:
         bool isSystem;
@@ -778,6 +941,91 @@ status_t XposedService::readFile(const String16& filename16, int32_t offset, int
     return err;
 }
 
+/**
+ * Reads new lines from the Xposed log. If since is > 0, lines written before that time are skipped
+ * by looking up the log index. Reading starts at offset (or later) and is limited to length bytes.
+ * The identity of the log and the offset for the next call are returned in nextLogId and nextOffset.
+ * If logId (0 for the first call) doesn't match anymore, the log has been recreated and reading
+ * starts from the beginning again.
+ */
+status_t XposedService::readLog(int64_t since, int64_t logId, int64_t offset, int32_t length,
+        int64_t* nextLogId, int64_t* nextOffset, uint8_t** buffer, int32_t* bytesRead, String16* errormsg) const {
+
+    uid_t caller = IPCThreadState::self()->getCallingUid();
+    if (caller != UID_SYSTEM) {
+        ALOGE("UID %d is not allowed to use the Xposed service", caller);
+        return EPERM;
+    }
+
+    *buffer = NULL;
+    *bytesRead = -1;
+
+    if (length <= 0 || length > READ_LOG_MAX_LENGTH) {
+        length = READ_LOG_MAX_LENGTH;
+    }
+
+    int fd = open(XPOSEDLOG, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        status_t err = errno;
+        if (errormsg) *errormsg = formatToString16("%s during open() on %s", strerror(err), XPOSEDLOG);
+        return err;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        status_t err = errno;
+        close(fd);
+        if (errormsg) *errormsg = formatToString16("%s during fstat() on %s", strerror(err), XPOSEDLOG);
+        return err;
+    }
+
+    // The log has been recreated since the last call (possibly growing beyond the old offset already),
+    // so start from the beginning
+    if ((logId != 0 && logId != (int64_t) st.st_ino) || offset > st.st_size || offset < 0) {
+        offset = 0;
+    }
+    *nextLogId = st.st_ino;
+
+    if (since > 0) {
+        int64_t indexedOffset = xposed::logcat::findLogOffset(since);
+        if (indexedOffset > offset && indexedOffset <= st.st_size)
+            offset = indexedOffset;
+    }
+
+    if (st.st_size - offset < length) {
+        length = st.st_size - offset;
+    }
+    *nextOffset = offset;
+    if (length == 0) {
+        close(fd);
+        *bytesRead = 0;
+        return 0;
+    }
+
+    *buffer = (uint8_t*) malloc(length + 1);
+    if (*buffer == NULL) {
+        close(fd);
+        if (errormsg) *errormsg = formatToString16("allocating buffer with %d bytes failed", length + 1);
+        return ENOMEM;
+    }
+
+    ssize_t result = TEMP_FAILURE_RETRY(pread(fd, *buffer, length, offset));
+    if (result < 0) {
+        status_t err = errno;
+        close(fd);
+        free(*buffer);
+        *buffer = NULL;
+        if (errormsg) *errormsg = formatToString16("%s during pread() at offset %" PRId64 " for %s", strerror(err), offset, XPOSEDLOG);
+        return err;
+    }
+    close(fd);
+
+    (*buffer)[result] = 0;
+    *bytesRead = result;
+    *nextOffset = offset + result;
+    return 0;
+}
+
 }  // namespace binder
 
 
@@ -818,12 +1066,16 @@ static void systemService() {
     IPCThreadState::self()->joinThreadPool();
 }
 
-static void appService() {
-    xposed::setProcessName("xposed_service_app");
+/**
+ * The Xposed daemon runs in app context. It serves the app service via binder, the memory-based
+ * Zygote service and captures the log, each of them in their own thread(s).
+ */
+static void daemonService(const char* startupMarker) {
+    xposed::setProcessName("xposed_daemon");
+    xposed::logcat::retainLogAccess();
     if (!xposed::switchToXposedInstallerUidGid()) {
         exit(EXIT_FAILURE);
     }
-    xposed::dropCapabilities();
 
 #if XPOSED_WITH_SELINUX
     if (xposed->isSELinuxEnabled) {
@@ -834,20 +1086,19 @@ static void appService() {
     }
 #endif  // XPOSED_WITH_SELINUX
 
-    // We have to register the app service by using the already running system service as a proxy
-    sp<IServiceManager> sm(defaultServiceManager());
-    sp<IBinder> systemBinder = sm->getService(String16(XPOSED_BINDER_SYSTEM_SERVICE_NAME));
-    sp<binder::IXposedService> xposedSystemService = interface_cast<binder::IXposedService>(systemBinder);
-    status_t err = xposedSystemService->addService(String16(XPOSED_BINDER_APP_SERVICE_NAME), new binder::XposedService(false), true);
+    // This process runs as Xposed Installer, so it doesn't need the Zygote service to read the configuration.
+    // Zygote loads it only after the services have been started.
+    xposed::readConfig(&xposed->config);
 
-    // Check result for the app service registration
-    if (err != NO_ERROR) {
-        ALOGE("Error %d while adding app service %s", err, XPOSED_BINDER_APP_SERVICE_NAME);
-        exit(EXIT_FAILURE);
-    }
+    // Logcat is forked, so it has to be started before any other threads. It still needs CAP_SYSLOG.
+    // The services don't depend on it, so continue without log in case of errors.
+    xposed::logcat::startCapture(startupMarker);
+    xposed::dropCapabilities();
+    stats::startServer();
 
 #if XPOSED_WITH_SELINUX
-    // Initialize the memory-based Zygote service
+    // Initialize the memory-based Zygote service first, Zygote is waiting for it.
+    // It doesn't depend on the binder services, which might take a while to be registered.
     if (xposed->isSELinuxEnabled) {
         pthread_t thMemBased;
         if (pthread_create(&thMemBased, NULL, &membased::looper, NULL) != 0) {
@@ -857,6 +1108,22 @@ static void appService() {
     }
 #endif  // XPOSED_WITH_SELINUX
 
+    // The module APKs are only accessible in app context. Only the system-wide page cache
+    // is filled here, so Zygote doesn't have to wait for it.
+    xposed::prefetchModules();
+
+    // We have to register the app service by using the already running system service as a proxy
+    sp<IServiceManager> sm(defaultServiceManager());
+    sp<IBinder> systemBinder = sm->getService(String16(XPOSED_BINDER_SYSTEM_SERVICE_NAME));
+    sp<binder::IXposedService> xposedSystemService = interface_cast<binder::IXposedService>(systemBinder);
+    status_t err = xposedSystemService->addService(String16(XPOSED_BINDER_APP_SERVICE_NAME), new binder::XposedService(false), true);
+
+    // Check result for the app service registration
+    if (err != NO_ERROR) {
+        ALOGE("Error %d while adding app service %s", err, XPOSED_BINDER_APP_SERVICE_NAME);
+        exit(EXIT_FAILURE);
+    }
+
     sp<ProcessState> ps(ProcessState::self());
     ps->startThreadPool();
 #if PLATFORM_SDK_VERSION >= 18
@@ -875,32 +1142,20 @@ bool checkMembasedRunning() {
     return true;
 }
 
-bool startAll() {
+bool startAll(const char* startupMarker) {
     if (xposed->isSELinuxEnabled && !membased::init()) {
         return false;
     }
 
-    // system context service
-    pid_t pid;
-    if ((pid = fork()) < 0) {
-        ALOGE("Fork for Xposed service in system context failed: %s", strerror(errno));
-        return false;
-    } else if (pid == 0) {
-        systemService();
-        // Should never reach this point
-        exit(EXIT_FAILURE);
-    }
-
-    // app context service
-    if ((pid = fork()) < 0) {
-        ALOGE("Fork for Xposed service in app context failed: %s", strerror(errno));
-        return false;
-    } else if (pid == 0) {
-        appService();
-        // Should never reach this point
-        exit(EXIT_FAILURE);
-    }
+    // system context service and the daemon for everything that runs in app context
+    bool success = xposed::spawnHelper("service_system") > 0
+        && xposed::spawnHelper("daemon", membased::sharedFd, startupMarker) > 0;
+    membased::closeSharedFd();
+    return success;
+}
 
+/** Waits until the services started by startAll() can be used by Zygote. */
+bool waitForStartup() {
     if (xposed->isSELinuxEnabled && !checkMembasedRunning()) {
         return false;
     }
@@ -918,28 +1173,50 @@ bool startMembased() {
         return false;
     }
 
-    pid_t pid;
-    if ((pid = fork()) < 0) {
-        ALOGE("Fork for Xposed Zygote service failed: %s", strerror(errno));
+    pid_t pid = xposed::spawnHelper("service_zygote", membased::sharedFd);
+    membased::closeSharedFd();
+    if (pid < 0) {
         return false;
-    } else if (pid == 0) {
-        xposed::setProcessName("xposed_zygote_service");
-        if (!xposed::switchToXposedInstallerUidGid()) {
-            exit(EXIT_FAILURE);
-        }
-        xposed::dropCapabilities();
-        if (setcon(ctx_app) != 0) {
-            ALOGE("Could not switch to %s context", ctx_app);
-            exit(EXIT_FAILURE);
-        }
-        membased::looper(NULL);
-        // Should never reach this point
-        exit(EXIT_FAILURE);
     }
 
     return checkMembasedRunning();
 }
+
+static void zygoteService() {
+    xposed::setProcessName("xposed_zygote_service");
+    if (!xposed::switchToXposedInstallerUidGid()) {
+        exit(EXIT_FAILURE);
+    }
+    xposed::dropCapabilities();
+    if (setcon(ctx_app) != 0) {
+        ALOGE("Could not switch to %s context", ctx_app);
+        exit(EXIT_FAILURE);
+    }
+    membased::looper(NULL);
+}
 #endif  // XPOSED_WITH_SELINUX
 
+/** Entry point for the service processes, which have been started with spawnHelper(). */
+void runHelper(const char* name, int fd, const char* arg) {
+    if (fd >= 0 && !membased::attach(fd)) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (strcmp(name, "service_system") == 0) {
+        systemService();
+    } else if (strcmp(name, "daemon") == 0) {
+        daemonService(arg);
+#if XPOSED_WITH_SELINUX
+    } else if (strcmp(name, "service_zygote") == 0) {
+        zygoteService();
+#endif  // XPOSED_WITH_SELINUX
+    } else {
+        ALOGE("Unknown helper process %s", name);
+    }
+
+    // Should never reach this point
+    exit(EXIT_FAILURE);
+}
+
 }  // namespace service
 }  // namespace xposed
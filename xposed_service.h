@@ -6,7 +6,9 @@
 
 namespace xposed {
 namespace service {
-    bool startAll();
+    bool startAll(const char* startupMarker);
+    bool waitForStartup();
+    void runHelper(const char* name, int fd, const char* arg);
 
 #if XPOSED_WITH_SELINUX
     bool startMembased();
@@ -15,6 +17,7 @@ namespace service {
         int accessFile(const char* path, int mode);
         int statFile(const char* path, struct stat* stat);
         char* readFile(const char* path, int* bytesRead);
+        int readConfig(XposedConfig* config);
         void restrictMemoryInheritance();
     }  // namespace membased
 #endif  // XPOSED_WITH_SELINUX
@@ -5,7 +5,9 @@
 #ifndef XPOSED_SHARED_H_
 #define XPOSED_SHARED_H_
 
+#include <stdint.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #include "cutils/log.h"
 #include "jni.h"
@@ -17,16 +19,55 @@
 #define ALOGE LOGE
 #define ALOGI LOGI
 #define ALOGV LOGV
+#define ALOGW LOGW
 #endif
 
+#define XPOSED_PACKAGE "de.robv.android.xposed.installer"
+// Can be overridden to run the startup code outside of Android, e.g. in a temporary directory
+#ifndef XPOSED_DATA_ROOT
 #if PLATFORM_SDK_VERSION >= 24
-#define XPOSED_DIR "/data/user_de/0/de.robv.android.xposed.installer/"
+#define XPOSED_DATA_ROOT "/data/user_de/0/"
 #else
-#define XPOSED_DIR "/data/data/de.robv.android.xposed.installer/"
+#define XPOSED_DATA_ROOT "/data/data/"
 #endif
+#endif
+#define XPOSED_DIR XPOSED_DATA_ROOT XPOSED_PACKAGE "/"
 
 namespace xposed {
 
+/** Snapshot of the files in the conf/ directory, loaded once during startup. */
+struct XposedConfig {
+    bool loaded;
+    bool disabled;          // conf/disabled
+    bool safemodeDisabled;  // conf/safemode_disable
+    bool safemodeNoDelay;   // conf/safemode_nodelay
+    bool logAll;            // conf/log_all
+    long logRateLimit;      // conf/log_ratelimit, 0 if not set
+    long logRateBurst;
+    int jitResetOffset;     // conf/jit_reset_offset, -1 if not set
+};
+
+/**
+ * Header of the per-process filter file prepared by Xposed Installer. It is followed by
+ * the sorted app IDs (uint32_t), the offsets of the sorted process names (uint32_t)
+ * and the NUL-terminated process names.
+ */
+#define PROCESS_FILTER_MAGIC    0x46505058  // "XPPF"
+#define PROCESS_FILTER_VERSION  1
+
+enum ProcessFilterFlags {
+    PROCESS_FILTER_ALLOWLIST = 1 << 0,  // modules are only loaded for the listed processes
+};
+
+struct ProcessFilterHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t appIdCount;
+    uint32_t nameCount;
+    uint32_t namesSize;
+};
+
 struct XposedShared {
     // Global variables
     bool zygote;
@@ -37,10 +78,18 @@ struct XposedShared {
     bool isSELinuxEnforcing;
     uid_t installer_uid;
     gid_t installer_gid;
+    uintptr_t runtimeLibBase;
+    char runtimeLibBuildId[41];
+    XposedConfig config;
+    const ProcessFilterHeader* processFilter;
+    size_t processFilterSize;
 
     // Provided by runtime-specific library, used by executable
     void (*onVmCreated)(JNIEnv* env);
 
+    // Provided by the executable, used by runtime-specific library
+    bool (*checkSafemode)();
+
 #if XPOSED_WITH_SELINUX
     // Provided by the executable, used by runtime-specific library
     int (*zygoteservice_accessFile)(const char* path, int mode);
@@ -51,6 +100,13 @@ struct XposedShared {
 
 extern XposedShared* xposed;
 
+/** Current time of the monotonic clock in ns, for measuring durations. */
+static inline int64_t monotonicNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
 } // namespace xposed
 
 #endif // XPOSED_SHARED_H_
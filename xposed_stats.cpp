@@ -0,0 +1,320 @@
+/**
+ * Counters and latency histograms for the Xposed services and the log daemon.
+ *
+ * Zygote creates the shared memory region and passes it to the helper processes, which
+ * update it with atomic operations only. The daemon hands out the file descriptor via
+ * XPOSED_STATS_SOCKET, so the current values can be printed with --xposedstats. As the
+ * daemon runs as Xposed Installer, only its UID and root can connect to the socket.
+ */
+#define LOG_TAG "Xposed"
+
+#include "xposed.h"
+#include "xposed_stats.h"
+
+#include <cutils/ashmem.h>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace xposed {
+namespace stats {
+
+////////////////////////////////////////////////////////////
+// Declarations
+////////////////////////////////////////////////////////////
+
+static const char* opNames[STATS_OP_COUNT] = {
+    "membased accessFile",
+    "membased statFile",
+    "membased readFile",
+    "membased readConfig",
+    "binder test",
+    "binder addService",
+    "binder accessFile",
+    "binder statFile",
+    "binder readFile",
+    "binder readLog",
+};
+
+static const char* counterNames[STATS_COUNTER_COUNT] = {
+    "log lines",
+    "log bytes",
+    "log lines dropped",
+    "helper starts",
+    "helper start failures",
+};
+
+static StatsRegion* region = NULL;
+static int regionFd = -1;
+
+
+////////////////////////////////////////////////////////////
+// Recording
+////////////////////////////////////////////////////////////
+
+void add(StatsCounter counter, uint64_t value) {
+    if (region != NULL)
+        __sync_fetch_and_add(&region->counters[counter], value);
+}
+
+void recordOp(StatsOp op, int64_t startNs, uint64_t bytes, bool error) {
+    if (region == NULL)
+        return;
+
+    uint64_t us = (monotonicNs() - startNs) / 1000;
+    int bucket = 0;
+    while (bucket < STATS_HISTOGRAM_BUCKETS - 1 && (us >> (bucket + 1)) != 0)
+        bucket++;
+
+    StatsOpData* data = &region->ops[op];
+    __sync_fetch_and_add(&data->count, 1);
+    __sync_fetch_and_add(&data->totalUs, us);
+    __sync_fetch_and_add(&data->histogram[bucket], 1);
+    if (bytes > 0)
+        __sync_fetch_and_add(&data->bytes, bytes);
+    if (error)
+        __sync_fetch_and_add(&data->errors, 1);
+}
+
+ScopedOp::ScopedOp(StatsOp op) : bytes(0), error(false), op(op), start(monotonicNs()) {}
+
+ScopedOp::~ScopedOp() {
+    recordOp(op, start, bytes, error);
+}
+
+
+////////////////////////////////////////////////////////////
+// Setup
+////////////////////////////////////////////////////////////
+
+/** Creates the region in Zygote. It stays mapped until the helpers have been started. */
+bool init() {
+    regionFd = ashmem_create_region("xposed_stats", sizeof(StatsRegion));
+    if (regionFd < 0) {
+        ALOGE("Could not allocate memory for statistics: %s", strerror(errno));
+        return false;
+    }
+    fcntl(regionFd, F_SETFD, FD_CLOEXEC);
+
+    void* addr = mmap(NULL, sizeof(StatsRegion), PROT_READ | PROT_WRITE, MAP_SHARED, regionFd, 0);
+    if (addr == MAP_FAILED) {
+        ALOGE("Could not map memory for statistics: %s", strerror(errno));
+        close(regionFd);
+        regionFd = -1;
+        return false;
+    }
+
+    region = (StatsRegion*) addr;
+    region->magic = XPOSED_STATS_MAGIC;
+    region->version = XPOSED_STATS_VERSION;
+    region->startTime = time(NULL);
+    return true;
+}
+
+int getFd() {
+    return regionFd;
+}
+
+/** Apps must not be able to modify the statistics, so Zygote doesn't keep the region. */
+void release() {
+    if (region != NULL) {
+        munmap(region, sizeof(StatsRegion));
+        region = NULL;
+    }
+    if (regionFd >= 0) {
+        close(regionFd);
+        regionFd = -1;
+    }
+}
+
+/** Maps the region in a helper process, the file descriptor is kept for startServer(). */
+bool attach(int fd) {
+    void* addr = mmap(NULL, sizeof(StatsRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        ALOGE("Could not map memory for statistics: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    region = (StatsRegion*) addr;
+    regionFd = fd;
+    add(STATS_HELPER_STARTS);
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////
+// Access for other processes
+////////////////////////////////////////////////////////////
+
+static void* serverThread(void* arg) {
+    int serverFd = (int)(intptr_t) arg;
+    bool readOnly = false;
+    while (1) {
+        int clientFd = TEMP_FAILURE_RETRY(accept(serverFd, NULL, NULL));
+        if (clientFd < 0) {
+            ALOGE("accept() failed for statistics: %s", strerror(errno));
+            break;
+        }
+
+        // Clients must not be able to map the region writable. This doesn't affect the existing
+        // mappings, and it's only done on the first request, when the helpers have attached.
+        if (!readOnly && ashmem_set_prot_region(regionFd, PROT_READ) != 0) {
+            ALOGE("Could not protect statistics: %s", strerror(errno));
+            close(clientFd);
+            continue;
+        }
+        readOnly = true;
+
+        char dummy = 0;
+        struct iovec iov = { &dummy, 1 };
+        char control[CMSG_SPACE(sizeof(int))];
+        memset(control, 0, sizeof(control));
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &regionFd, sizeof(int));
+
+        if (TEMP_FAILURE_RETRY(sendmsg(clientFd, &msg, 0)) < 0)
+            ALOGW("Could not send statistics to client: %s", strerror(errno));
+        close(clientFd);
+    }
+    close(serverFd);
+    return NULL;
+}
+
+/** Runs in the daemon, hands out the file descriptor of the region to --xposedstats. */
+void startServer() {
+    if (regionFd < 0)
+        return;
+
+    int serverFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (serverFd < 0) {
+        ALOGE("Could not create socket for statistics: %s", strerror(errno));
+        return;
+    }
+    fcntl(serverFd, F_SETFD, FD_CLOEXEC);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, XPOSED_STATS_SOCKET, sizeof(addr.sun_path));
+    unlink(XPOSED_STATS_SOCKET);
+
+    // Helpers inherit umask 0 from Zygote, create the socket with restricted permissions right away
+    mode_t oldUmask = umask(077);
+    int err = bind(serverFd, (struct sockaddr*) &addr, sizeof(addr));
+    umask(oldUmask);
+    if (err != 0 || listen(serverFd, 2) != 0) {
+        ALOGE("Could not listen on %s: %s", XPOSED_STATS_SOCKET, strerror(errno));
+        close(serverFd);
+        return;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &serverThread, (void*)(intptr_t) serverFd) != 0) {
+        ALOGE("Could not create thread for statistics: %s", strerror(errno));
+        close(serverFd);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+static int receiveFd() {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, XPOSED_STATS_SOCKET, sizeof(addr.sun_path));
+    if (TEMP_FAILURE_RETRY(connect(sock, (struct sockaddr*) &addr, sizeof(addr))) != 0) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+
+    char dummy;
+    struct iovec iov = { &dummy, 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int fd = -1;
+    if (TEMP_FAILURE_RETRY(recvmsg(sock, &msg, 0)) > 0) {
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        else
+            errno = EPROTO;
+    }
+    close(sock);
+    return fd;
+}
+
+/** Prints the current statistics, used for --xposedstats. */
+void dump() {
+    int fd = receiveFd();
+    if (fd < 0) {
+        printf("Could not connect to %s: %s\n", XPOSED_STATS_SOCKET, strerror(errno));
+        return;
+    }
+
+    const StatsRegion* stats = (const StatsRegion*) mmap(NULL, sizeof(StatsRegion), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (stats == MAP_FAILED) {
+        printf("Could not map statistics: %s\n", strerror(errno));
+        return;
+    }
+
+    if (stats->magic != XPOSED_STATS_MAGIC || stats->version != XPOSED_STATS_VERSION) {
+        printf("Unsupported statistics format (magic %08x, version %u)\n", stats->magic, stats->version);
+        munmap((void*) stats, sizeof(StatsRegion));
+        return;
+    }
+
+    printf("Collected for %" PRId64 " s\n\n", (int64_t) time(NULL) - stats->startTime);
+    for (int i = 0; i < STATS_COUNTER_COUNT; i++)
+        printf("%-24s %" PRIu64 "\n", counterNames[i], stats->counters[i]);
+
+    printf("\n%-24s %8s %8s %12s %10s  histogram (bucket i: >= 2^i us)\n", "operation", "count", "errors", "bytes", "avg us");
+    for (int i = 0; i < STATS_OP_COUNT; i++) {
+        const StatsOpData* op = &stats->ops[i];
+        if (op->count == 0)
+            continue;
+        printf("%-24s %8" PRIu64 " %8" PRIu64 " %12" PRIu64 " %10" PRIu64 " ",
+            opNames[i], op->count, op->errors, op->bytes, op->totalUs / op->count);
+        for (int b = 0; b < STATS_HISTOGRAM_BUCKETS; b++)
+            printf(" %" PRIu64, op->histogram[b]);
+        printf("\n");
+    }
+
+    munmap((void*) stats, sizeof(StatsRegion));
+}
+
+}  // namespace stats
+}  // namespace xposed
@@ -0,0 +1,82 @@
+#ifndef XPOSED_STATS_H_
+#define XPOSED_STATS_H_
+
+#include <stdint.h>
+
+#ifndef XPOSED_STATS_SOCKET
+#define XPOSED_STATS_SOCKET      XPOSED_DIR "stats.sock"
+#endif
+#define XPOSED_STATS_MAGIC       0x54535058  // "XPST"
+#define XPOSED_STATS_VERSION     1
+
+// Bucket i counts latencies in [2^i, 2^(i+1)) us, the last one everything above
+#define STATS_HISTOGRAM_BUCKETS  16
+
+namespace xposed {
+namespace stats {
+
+    enum StatsOp {
+        STATS_MEMBASED_ACCESS_FILE,
+        STATS_MEMBASED_STAT_FILE,
+        STATS_MEMBASED_READ_FILE,
+        STATS_MEMBASED_READ_CONFIG,
+        STATS_BINDER_TEST,
+        STATS_BINDER_ADD_SERVICE,
+        STATS_BINDER_ACCESS_FILE,
+        STATS_BINDER_STAT_FILE,
+        STATS_BINDER_READ_FILE,
+        STATS_BINDER_READ_LOG,
+        STATS_OP_COUNT
+    };
+
+    enum StatsCounter {
+        STATS_LOG_LINES,
+        STATS_LOG_BYTES,
+        STATS_LOG_DROPPED,
+        STATS_HELPER_STARTS,
+        STATS_HELPER_FAILURES,
+        STATS_COUNTER_COUNT
+    };
+
+    struct StatsOpData {
+        uint64_t count;
+        uint64_t errors;
+        uint64_t bytes;
+        uint64_t totalUs;
+        uint64_t histogram[STATS_HISTOGRAM_BUCKETS];
+    };
+
+    /** Shared between Zygote and the helper processes, all fields are only updated atomically. */
+    struct StatsRegion {
+        uint32_t magic;
+        uint32_t version;
+        int64_t startTime;  // seconds since the epoch
+        uint64_t counters[STATS_COUNTER_COUNT];
+        StatsOpData ops[STATS_OP_COUNT];
+    };
+
+    /** Records the duration of an operation when it goes out of scope. */
+    class ScopedOp {
+      public:
+        explicit ScopedOp(StatsOp op);
+        ~ScopedOp();
+        uint64_t bytes;
+        bool error;
+      private:
+        StatsOp op;
+        int64_t start;
+    };
+
+    bool init();
+    int getFd();
+    void release();
+    bool attach(int fd);
+    void add(StatsCounter counter, uint64_t value = 1);
+    void recordOp(StatsOp op, int64_t startNs, uint64_t bytes, bool error);
+    void startServer();
+    void dump();
+
+}  // namespace stats
+}  // namespace xposed
+
+#endif  // XPOSED_STATS_H_